@@ -0,0 +1,467 @@
+/*! nitrofs micro-benchmarks
+ *
+ *  Builds a synthetic NDS file, loads it with nitrofs' own code and times
+ *  the serving paths in-process, without a mount, so the numbers exclude
+ *  the kernel and /dev/fuse round trips.
+ *
+ *  usage: nitrobench lookup [files]
+ *         nitrobench threads [max_threads]
+ *         nitrobench chunk
+ *         nitrobench huge
+ */
+#define main nitrofs_main
+#include "../nitrofs.c"
+#undef main
+
+#include "rom.h"
+
+/*! Synthetic NDS file written by each benchmark */
+#define BENCH_ROM "nitrobench.nds"
+
+/*! Get a monotonic time
+ *
+ *  @returns seconds
+ */
+static double
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*! Fill a buffer with reproducible noise
+ *
+ *  @param[out] buf  Buffer to fill
+ *  @param[in]  size Size of buffer
+ *  @param[in]  seed Seed
+ */
+static void
+bench_noise(unsigned char *buf,
+            size_t        size,
+            uint32_t      seed)
+{
+  size_t i;
+
+  for(i = 0; i < size; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+/*! Write a synthetic NDS file of equally sized files and load it
+ *
+ *  @param[in]  nfiles Number of files
+ *  @param[in]  size   Size of each file
+ *  @param[out] names  Set to the file names (free with free)
+ *
+ *  @returns root directory of the loaded tree
+ *  @returns NULL for failure
+ */
+static nitrofs_entry_t*
+bench_load(uint32_t nfiles,
+           uint32_t size,
+           char     **names)
+{
+  rom_file_t      *files;
+  unsigned char   *data;
+  nitrofs_entry_t *dir;
+  nitro_image_t   *pin = NULL;
+  uint32_t        i;
+
+  files = (rom_file_t*)calloc(nfiles, sizeof(*files));
+  *names = (char*)malloc((size_t)nfiles * 16);
+  data = (unsigned char*)malloc(size ? size : 1);
+  if(files == NULL || *names == NULL || data == NULL)
+    return NULL;
+
+  bench_noise(data, size, nfiles);
+  for(i = 0; i < nfiles; ++i)
+  {
+    snprintf(*names + (size_t)i * 16, 16, "f%06u.bin", i);
+    files[i].name = *names + (size_t)i * 16;
+    files[i].data = data;
+    files[i].size = size;
+  }
+
+  if(rom_write(BENCH_ROM, files, nfiles) != 0 || nitro_single_rom(BENCH_ROM) != 0)
+  {
+    perror(BENCH_ROM);
+    return NULL;
+  }
+  free(files);
+  free(data);
+
+  dir = nitro_resolve(root, &pin);
+  nitro_image_put(pin, 1);
+  if(dir == NULL || nitro_load_dir(dir) != 0)
+    return NULL;
+  return dir;
+}
+
+/*! Release the synthetic NDS file
+ *
+ *  @param[in] names File names from bench_load
+ */
+static void
+bench_unload(char *names)
+{
+  nitro_free_roms();
+  free(names);
+  unlink(BENCH_ROM);
+}
+
+/*! Time name lookups in one large directory
+ *
+ *  The linear scan is the lookup nitrofs used before directories were
+ *  hashed: strcmp against every sibling in turn.
+ *
+ *  @param[in] nfiles Number of files in the directory
+ *
+ *  @returns 0 for success
+ *  @returns 1 for failure
+ */
+static int
+bench_lookup(uint32_t nfiles)
+{
+  nitrofs_entry_t *dir, *entry;
+  char            *names, *name;
+  uint32_t        i, n, found = 0;
+  unsigned int    rounds = 1 + 2000000 / nfiles / (nfiles < 1000 ? 1 : nfiles / 1000);
+  double          start, linear, hashed;
+
+  dir = bench_load(nfiles, 16, &names);
+  if(dir == NULL)
+    return 1;
+
+  start = bench_now();
+  for(n = 0; n < rounds; ++n)
+  {
+    for(i = 0; i < nfiles; ++i)
+    {
+      name = names + (size_t)i * 16;
+      for(entry = dir->children; entry != NULL; entry = entry->next)
+      {
+        if(strcmp(name, entry->name) == 0)
+        {
+          ++found;
+          break;
+        }
+      }
+    }
+  }
+  linear = (bench_now() - start) / rounds / nfiles;
+
+  start = bench_now();
+  for(n = 0; n < rounds; ++n)
+  {
+    for(i = 0; i < nfiles; ++i)
+    {
+      name = names + (size_t)i * 16;
+      if(nitro_lookup(dir, name, strlen(name)) != NULL)
+        ++found;
+    }
+  }
+  hashed = (bench_now() - start) / rounds / nfiles;
+
+  printf("%8" PRIu32 " files: linear %10.1f ns  hashed %6.1f ns  (%.0fx)\n",
+         nfiles, linear * 1e9, hashed * 1e9, linear / hashed);
+
+  bench_unload(names);
+  return found == 2 * rounds * nfiles ? 0 : 1;
+}
+
+/*! Reader thread state */
+typedef struct
+{
+  nitrofs_entry_t *dir;      /*!< Directory holding the files */
+  unsigned int    first;     /*!< First file to read */
+  unsigned int    stride;    /*!< Distance between files to read */
+  unsigned int    rounds;    /*!< Number of passes over the files */
+  uint64_t        bytes;     /*!< Bytes read */
+} bench_reader_t;
+
+/*! Read every stride-th file in 128 KiB chunks, as the kernel asks for them
+ *
+ *  @param[in,out] arg Reader thread state
+ *
+ *  @returns NULL
+ */
+static void*
+bench_reader(void *arg)
+{
+  bench_reader_t        *reader = (bench_reader_t*)arg;
+  static __thread char  buffer[128 << 10];
+  struct fuse_file_info fi;
+  nitrofs_entry_t       *entry;
+  unsigned int          n, i;
+  off_t                 offset;
+  int                   rc;
+
+  memset(&fi, 0, sizeof(fi));
+  for(n = 0; n < reader->rounds; ++n)
+  {
+    for(i = reader->first; i < reader->dir->nchildren; i += reader->stride)
+    {
+      entry = &reader->dir->children[i];
+      fi.fh = (unsigned long)entry;
+      for(offset = 0; (rc = nitro_read(NULL, buffer, sizeof(buffer), offset, &fi)) > 0; offset += rc)
+        reader->bytes += rc;
+    }
+  }
+
+  return NULL;
+}
+
+/*! Time concurrent reads of different files
+ *
+ *  @param[in] max_threads Largest number of reader threads to try
+ *
+ *  @returns 0 for success
+ *  @returns 1 for failure
+ */
+static int
+bench_threads(unsigned int max_threads)
+{
+  bench_reader_t  readers[64];
+  pthread_t       threads[64];
+  nitrofs_entry_t *dir;
+  char            *names;
+  unsigned int    nthreads, i;
+  uint64_t        bytes;
+  double          start, secs;
+
+  if(max_threads > 64)
+    max_threads = 64;
+
+  /* 64 files of 1 MiB, read 16 times over per thread count */
+  dir = bench_load(64, 1 << 20, &names);
+  if(dir == NULL)
+    return 1;
+
+  for(nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+  {
+    start = bench_now();
+    for(i = 0; i < nthreads; ++i)
+    {
+      readers[i] = (bench_reader_t){ .dir = dir, .first = i, .stride = nthreads, .rounds = 16, };
+      pthread_create(&threads[i], NULL, bench_reader, &readers[i]);
+    }
+    for(i = 0, bytes = 0; i < nthreads; ++i)
+    {
+      pthread_join(threads[i], NULL);
+      bytes += readers[i].bytes;
+    }
+    secs = bench_now() - start;
+
+    printf("%3u threads: %8.1f MiB/s\n", nthreads, bytes / secs / (1 << 20));
+  }
+
+  bench_unload(names);
+  return 0;
+}
+
+/*! Read a file front to back, over and over
+ *
+ *  @param[in]  file   File to read
+ *  @param[out] buffer Buffer of at least chunk bytes
+ *  @param[in]  chunk  Size of each read
+ *  @param[in]  total  Number of bytes to read in all
+ *
+ *  @returns seconds taken
+ *  @returns -1 for failure
+ */
+static double
+bench_sequential(nitrofs_entry_t *file,
+                 char            *buffer,
+                 size_t          chunk,
+                 uint64_t        total)
+{
+  struct fuse_file_info fi;
+  uint64_t              bytes = 0;
+  off_t                 offset = 0;
+  double                start;
+  int                   rc;
+
+  memset(&fi, 0, sizeof(fi));
+  fi.fh = (unsigned long)file;
+
+  start = bench_now();
+  while(bytes < total)
+  {
+    rc = nitro_read(NULL, buffer, chunk, offset, &fi);
+    if(rc < 0)
+      return -1;
+
+    bytes  += rc;
+    offset  = rc > 0 ? offset + rc : 0;
+  }
+
+  return bench_now() - start;
+}
+
+/*! Read a file at random offsets
+ *
+ *  @param[in]  file   File to read
+ *  @param[out] buffer Buffer of at least chunk bytes
+ *  @param[in]  chunk  Size of each read
+ *  @param[in]  count  Number of reads
+ *
+ *  @returns seconds taken
+ *  @returns -1 for failure
+ */
+static double
+bench_random(nitrofs_entry_t *file,
+             char            *buffer,
+             size_t          chunk,
+             uint32_t        count)
+{
+  struct fuse_file_info fi;
+  uint32_t              seed = 1, i;
+  off_t                 offset;
+  double                start;
+
+  memset(&fi, 0, sizeof(fi));
+  fi.fh = (unsigned long)file;
+
+  start = bench_now();
+  for(i = 0; i < count; ++i)
+  {
+    seed   = seed * 1103515245 + 12345;
+    offset = ((uint64_t)seed * (file->size / chunk) >> 32) * chunk;
+    if(nitro_read(NULL, buffer, chunk, offset, &fi) != (int)chunk)
+      return -1;
+  }
+
+  return bench_now() - start;
+}
+
+/*! Time streaming one large file in different read sizes
+ *
+ *  The kernel splits reads at max_read, so each size here is one FUSE
+ *  request. In-process, this is the filesystem's share of the cost only;
+ *  through a mount, every request also costs a round trip through
+ *  /dev/fuse.
+ *
+ *  @returns 0 for success
+ *  @returns 1 for failure
+ */
+static int
+bench_chunk(void)
+{
+  nitrofs_entry_t *dir;
+  char            *names, *buffer;
+  size_t          chunk;
+  uint64_t        total = (uint64_t)1 << 30;
+  double          secs;
+  int             rc = 0;
+
+  /* one 64 MiB file, like a large sound archive, read 1 GiB at a time */
+  buffer = (char*)malloc(1 << 20);
+  dir = bench_load(1, 64 << 20, &names);
+  if(buffer == NULL || dir == NULL)
+    return 1;
+
+  /* fault it in first */
+  bench_sequential(&dir->children[0], buffer, 1 << 20, 64 << 20);
+
+  for(chunk = 4 << 10; chunk <= 1 << 20 && rc == 0; chunk *= 2)
+  {
+    secs = bench_sequential(&dir->children[0], buffer, chunk, total);
+    if(secs < 0)
+      rc = 1;
+    else
+      printf("%5zu KiB reads: %8.1f MiB/s  %7" PRIu64 " requests/GiB  %6.0f ns/request\n",
+             chunk >> 10, total / secs / (1 << 20), total / chunk, secs / (total / chunk) * 1e9);
+  }
+
+  bench_unload(names);
+  free(buffer);
+  return rc;
+}
+
+/*! Time reads served from the file mapping and from copies in memory
+ *
+ *  Random 4 KiB reads touch a new page almost every time, so they show
+ *  the TLB misses huge pages avoid; sequential 128 KiB reads are mostly
+ *  copying.
+ *
+ *  @returns 0 for success
+ *  @returns 1 for failure
+ */
+static int
+bench_huge(void)
+{
+  static const char *modes[] = { "file mmap", "preload", "hugepages", };
+  nitrofs_entry_t   *dir;
+  char              *names, *buffer;
+  double            rand_secs, seq_secs;
+  uint32_t          count = 1 << 20;
+  uint64_t          total = (uint64_t)1 << 30;
+  unsigned int      mode;
+  int               rc = 0;
+
+  buffer = (char*)malloc(128 << 10);
+  if(buffer == NULL)
+    return 1;
+
+  for(mode = 0; mode < 3 && rc == 0; ++mode)
+  {
+    nitro_opts.preload   = mode == 1;
+    nitro_opts.hugepages = mode == 2;
+
+    /* one 256 MiB file, faulted in before timing */
+    dir = bench_load(1, 256 << 20, &names);
+    if(dir == NULL)
+    {
+      rc = 1;
+      break;
+    }
+    bench_sequential(&dir->children[0], buffer, 128 << 10, 256 << 20);
+
+    rand_secs = bench_random(&dir->children[0], buffer, 4 << 10, count);
+    seq_secs  = bench_sequential(&dir->children[0], buffer, 128 << 10, total);
+    if(rand_secs < 0 || seq_secs < 0)
+      rc = 1;
+    else
+      printf("%-10s random 4 KiB: %8.1f MiB/s  sequential 128 KiB: %8.1f MiB/s\n",
+             modes[mode], (uint64_t)count * (4 << 10) / rand_secs / (1 << 20),
+             total / seq_secs / (1 << 20));
+
+    bench_unload(names);
+  }
+
+  nitro_opts.preload   = 0;
+  nitro_opts.hugepages = 0;
+  free(buffer);
+  return rc;
+}
+
+int main(int argc, char *argv[])
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(argc >= 2 && strcmp(argv[1], "lookup") == 0)
+  {
+    if(argc >= 3)
+      return bench_lookup(strtoul(argv[2], NULL, 0));
+    return bench_lookup(100) | bench_lookup(1000) | bench_lookup(20000);
+  }
+
+  if(argc >= 2 && strcmp(argv[1], "threads") == 0)
+    return bench_threads(argc >= 3 ? strtoul(argv[2], NULL, 0) : (unsigned int)(ncpus > 1 ? ncpus : 1));
+
+  if(argc >= 2 && strcmp(argv[1], "chunk") == 0)
+    return bench_chunk();
+
+  if(argc >= 2 && strcmp(argv[1], "huge") == 0)
+    return bench_huge();
+
+  fprintf(stderr, "usage: %s lookup [files]\n"
+                  "       %s threads [max_threads]\n"
+                  "       %s chunk\n"
+                  "       %s huge\n", argv[0], argv[0], argv[0], argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+/*! Synthetic NDS file writer for the benchmarks and tests
+ *
+ *  Writes just enough of an NDS file for nitrofs: a header locating the
+ *  FNT and FAT, an FNT with every file in the root directory, and the
+ *  file data, each file aligned to 4 bytes.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*! File to put in a synthetic NDS file */
+typedef struct
+{
+  const char          *name; /*!< File name (at most 127 bytes) */
+  const unsigned char *data; /*!< File contents (NULL for zeros) */
+  uint32_t            size;  /*!< File size */
+} rom_file_t;
+
+/*! Store a little-endian word
+ *
+ *  @param[out] p Where to store it
+ *  @param[in]  v Value to store
+ */
+static void
+rom_put32(unsigned char *p,
+          uint32_t      v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/*! Write a synthetic NDS file
+ *
+ *  @param[in] path   File to write
+ *  @param[in] files  Files to put in its root directory
+ *  @param[in] nfiles Number of files
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+rom_write(const char       *path,
+          const rom_file_t *files,
+          uint32_t         nfiles)
+{
+  static const unsigned char zeros[4096];
+  unsigned char header[0x200] = { 0 };
+  unsigned char *fnt, *fat, *p;
+  uint32_t      fnt_len = 8 + 1, fat_off, data_off, pos, i;
+  FILE          *fp;
+  int           rc = 0;
+
+  for(i = 0; i < nfiles; ++i)
+    fnt_len += 1 + strlen(files[i].name);
+
+  fnt = (unsigned char*)calloc(1, fnt_len);
+  fat = (unsigned char*)calloc(nfiles ? nfiles : 1, 8);
+  if(fnt == NULL || fat == NULL)
+  {
+    free(fnt);
+    free(fat);
+    return -1;
+  }
+
+  /* the root's main entry: sub-table offset, first file ID, directory count */
+  rom_put32(fnt, 8);
+  fnt[6] = 1;
+  for(i = 0, p = fnt + 8; i < nfiles; ++i)
+  {
+    *p++ = strlen(files[i].name);
+    memcpy(p, files[i].name, strlen(files[i].name));
+    p += strlen(files[i].name);
+  }
+
+  fat_off  = (0x200 + fnt_len + 0x1FF) & ~0x1FF;
+  data_off = (fat_off + nfiles * 8 + 0x1FF) & ~0x1FF;
+  for(i = 0, pos = data_off; i < nfiles; ++i)
+  {
+    rom_put32(fat + i*8,     pos);
+    rom_put32(fat + i*8 + 4, pos + files[i].size);
+    pos = (pos + files[i].size + 3) & ~3;
+  }
+
+  rom_put32(header + 0x40, 0x200);
+  rom_put32(header + 0x44, fnt_len);
+  rom_put32(header + 0x48, fat_off);
+  rom_put32(header + 0x4C, nfiles * 8);
+
+  fp = fopen(path, "wb");
+  if(fp == NULL)
+    rc = -1;
+  else
+  {
+    fwrite(header, 1, sizeof(header), fp);
+    fwrite(fnt, 1, fnt_len, fp);
+    fseek(fp, fat_off, SEEK_SET);
+    fwrite(fat, 8, nfiles, fp);
+    for(i = 0, pos = data_off; i < nfiles; ++i)
+    {
+      uint32_t left = files[i].size;
+
+      fseek(fp, pos, SEEK_SET);
+      if(files[i].data != NULL)
+        fwrite(files[i].data, 1, left, fp);
+      else
+      {
+        while(left > 0)
+        {
+          uint32_t n = left < sizeof(zeros) ? left : sizeof(zeros);
+
+          fwrite(zeros, 1, n, fp);
+          left -= n;
+        }
+      }
+      pos = (pos + files[i].size + 3) & ~3;
+    }
+
+    /* pad out the last file */
+    if(fflush(fp) != 0 || ftruncate(fileno(fp), pos) != 0)
+      rc = -1;
+    if(fclose(fp) != 0)
+      rc = -1;
+  }
+
+  free(fnt);
+  free(fat);
+  return rc;
+}
@@ -3,12 +3,37 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
+/*! Offset to ARM9 binary offset */
+#define ARM9_OFFSET 0x20
+
+/*! Offset to ARM9 binary length */
+#define ARM9_LENGTH 0x2C
+
+/*! Offset to ARM7 binary offset */
+#define ARM7_OFFSET 0x30
+
+/*! Offset to ARM7 binary length */
+#define ARM7_LENGTH 0x3C
+
 /*! Offset to file name table offset */
 #define FNT_OFFSET 0x40
 
@@ -21,12 +46,48 @@
 /*! Offset to file allocation length */
 #define FAT_LENGTH 0x4C
 
+/*! Offset to ARM9 overlay table offset */
+#define OVT9_OFFSET 0x50
+
+/*! Offset to ARM9 overlay table length */
+#define OVT9_LENGTH 0x54
+
+/*! Offset to ARM7 overlay table offset */
+#define OVT7_OFFSET 0x58
+
+/*! Offset to ARM7 overlay table length */
+#define OVT7_LENGTH 0x5C
+
+/*! Offset to banner offset */
+#define BANNER_OFFSET 0x68
+
+/*! Minimum header size needed to locate the FNT and FAT */
+#define NITRO_HEADER_MIN 0x50
+
 /*! NitroFS root directory ID */
 #define NITRO_ROOT    0xF000
 
 /*! NitroFS directory ID mask */
 #define NITRO_DIRMASK 0x0FFF
 
+/*! Size of the NDS header as presented in /.sys */
+#define NITRO_HEADER_SIZE 0x200
+
+/*! Size of an overlay table entry */
+#define NITRO_OVERLAY_ENTRY 0x20
+/*! Offset of the file ID in an overlay table entry */
+#define NITRO_OVERLAY_FILE_ID 0x18
+
+/*! Number of fixed entries in /.sys, counting itself */
+#define NITRO_SYS_ENTRIES 9
+
+/*! NARC archive header size (minimum) */
+#define NARC_HEADER_MIN 0x10
+/*! NARC section header size */
+#define NARC_SECTION_HEADER 0x08
+/*! NARC FAT section header size */
+#define NARC_BTAF_HEADER 0x0C
+
 /*! NitroFS entry type */
 typedef enum
 {
@@ -39,46 +100,333 @@ typedef enum
 /*! NitroFS file mode (-r--r--r--) */
 #define NITRO_FILE_MODE (S_IRUSR|S_IRGRP|S_IROTH|S_IFREG)
 
-/*! NDS file name */
-static const char *nds_file = NULL;
-/*! NDS file size */
-static size_t     nds_size;
+/*! Default entry, attribute and negative lookup timeout (one year)
+ *
+ *  The tree never changes while it is mounted, so the kernel may cache
+ *  lookups and attributes effectively forever.
+ */
+#define NITRO_TIMEOUT (365.0 * 24 * 60 * 60)
+
+/*! Default derived data cache budget (MiB) */
+#define NITRO_CACHE_SIZE 64
+
+/*! Largest part of a file prefetched when it is opened (bytes)
+ *
+ *  Read-ahead takes over from there; prefetching all of a large file
+ *  would hold up the open while its I/O is queued.
+ */
+#define NITRO_PREFETCH (4 << 20)
+
+/*! Huge page size and alignment for in-memory copies of NDS files */
+#define NITRO_HUGE_PAGE (2 << 20)
+
+/*! Size of each read when copying an NDS file into memory */
+#define NITRO_PRELOAD_CHUNK (8 << 20)
+
+/*! Default number of concurrent reads when copying an NDS file */
+#define NITRO_PRELOAD_THREADS 8
 
-/*! NDS file last access time */
-static time_t nds_atime;
-/*! NDS file last modification time */
-static time_t nds_mtime;
-/*! NDS file last attribute change time */
-static time_t nds_ctime;
+/*! Number of derived data cache hash buckets (power of two) */
+#define NITRO_CACHE_BUCKETS 4096
 
-/*! NDS file mmap address */
-static unsigned char *nds_mapping;
+/*! LZ77 compression type (BIOS-compatible) */
+#define NITRO_LZ10 0x10
+/*! LZ77 compression type with extended match lengths */
+#define NITRO_LZ11 0x11
 
-/*! Filename table offset */
-static uint32_t fnt_offset;
-static uint32_t fnt_length;
-static uint32_t fat_offset;
-static uint32_t fat_length;
+/*! LZ77 verdict: the file hasn't been checked yet */
+#define NITRO_LZ_UNKNOWN 0
+/*! LZ77 verdict: the file is presented as stored */
+#define NITRO_LZ_RAW     1
+/*! LZ77 verdict: the file is presented decompressed */
+#define NITRO_LZ_PACKED  2
+
+/*! Lookup count passed to forget */
+#if FUSE_USE_VERSION >= 30
+typedef uint64_t nitro_nlookup_t;
+#else
+typedef unsigned long nitro_nlookup_t;
+#endif
+
+/*! NDS file name (or directory of NDS files in multi mode) */
+static const char *nds_file = NULL;
 
 /*! Typedef for nitrofs_entry_t */
 typedef struct nitrofs_entry_t nitrofs_entry_t;
 
+/*! Typedef for nitro_image_t */
+typedef struct nitro_image_t nitro_image_t;
+
+/*! Typedef for nitro_rom_t */
+typedef struct nitro_rom_t nitro_rom_t;
+
+/*! Typedef for nitro_block_t */
+typedef struct nitro_block_t nitro_block_t;
+
 /*! NitroFS entry */
 struct nitrofs_entry_t
 {
-  nitrofs_entry_t *parent;   /*!< Pointer to parent entry */
-  nitrofs_entry_t *next;     /*!< Pointer to next entry (sibling) */
-  nitrofs_entry_t *children; /*!< Pointer to first child entry */
-  nitro_type_t    type;      /*!< File or directory */
-  uint32_t        size;      /*!< Entry size */
-  uint32_t        links;     /*!< Number of links */
-  uint16_t        id;        /*!< Entry ID */
-  char            name[];    /*!< Entry name */
+  nitrofs_entry_t *parent;    /*!< Pointer to parent entry */
+  nitrofs_entry_t *next;      /*!< Pointer to next entry (sibling) */
+  nitrofs_entry_t *children;  /*!< Pointer to first child entry (the rest follow it) */
+  nitrofs_entry_t *hash_next; /*!< Pointer to next entry in hash bucket */
+  nitrofs_entry_t **buckets;  /*!< Child hash buckets, or children by ID (directories) */
+  nitro_image_t   *image;     /*!< NDS image this entry belongs to */
+  nitro_rom_t     *rom;       /*!< NDS file mounted here (mount directories) */
+  nitro_image_t   *archive;   /*!< Archive browsed here (NARC directories) */
+  uint32_t        nbuckets;   /*!< Number of hash buckets (power of two), or of IDs */
+  uint32_t        nchildren;  /*!< Number of children */
+  uint32_t        loaded;     /*!< Children have been parsed (directories) */
+  nitro_type_t    type;       /*!< File or directory */
+  uint32_t        offset;     /*!< Data offset in the NDS file */
+  uint32_t        size;       /*!< Entry size */
+  uint32_t        links;      /*!< Number of links */
+  uint32_t        hash;       /*!< Hash of entry name */
+  uint32_t        lz_size;    /*!< Decompressed size (NITRO_LZ_PACKED files) */
+  uint32_t        opens;      /*!< Number of open handles (files; under the cache lock) */
+  nitro_block_t   *pinned;    /*!< Contents too large for the cache, kept while open */
+  uint16_t        id;         /*!< Entry ID */
+  uint8_t         namelen;    /*!< Length of entry name */
+  uint8_t         sys;        /*!< Part of /.sys (always presented as stored) */
+  uint8_t         by_id;      /*!< Names every FAT entry by ID (/.by-id, nameless archives) */
+  uint8_t         broken;     /*!< Children failed to parse; don't retry (directories) */
+  uint8_t         lz;         /*!< LZ77 verdict (NITRO_LZ_*; files) */
+  uint8_t         lz_hdr;     /*!< LZ77 header length (NITRO_LZ_PACKED files) */
+  const char      *name;      /*!< Entry name */
+};
+
+/*! Tree storage
+ *
+ *  Entries, hash buckets and names all live in a single page-aligned
+ *  mapping sized up front from the FNT and FAT lengths. A directory's
+ *  children are allocated consecutively, so each listing is a contiguous
+ *  run of entries.
+ */
+typedef struct
+{
+  void            *base;       /*!< Backing allocation */
+  nitrofs_entry_t *entries;    /*!< Entry storage */
+  nitrofs_entry_t **buckets;   /*!< Hash bucket storage */
+  char            *names;      /*!< Name storage */
+  size_t          nentries;    /*!< Number of entries in use */
+  size_t          max_entries; /*!< Entry capacity */
+  size_t          nbuckets;    /*!< Number of buckets in use */
+  size_t          max_buckets; /*!< Bucket capacity */
+  size_t          names_len;   /*!< Number of name bytes in use */
+  size_t          max_names;   /*!< Name capacity */
+  size_t          size;        /*!< Size of the backing allocation */
+} nitro_arena_t;
+
+/*! NDS image
+ *
+ *  One mapping of an NDS file and the tree parsed from it. When the file
+ *  changes, a new image replaces the old one, which lives on until the
+ *  last reference to it is dropped. References are held by the NDS file
+ *  while the image is current, by open files and directories, by inodes
+ *  the kernel has looked up, and briefly by operations passing through a
+ *  mount directory.
+ *
+ *  A NARC archive inside an image gets an image of its own for its
+ *  tables and tree. It shares its owner's mapping, and references to it
+ *  are taken on its owner, which frees it.
+ */
+struct nitro_image_t
+{
+  const char      *file;        /*!< NDS file name */
+  nitro_rom_t     *rom;         /*!< NDS file this is an image of */
+  nitro_image_t   *owner;       /*!< Image holding the mapping (itself unless an archive) */
+  nitro_image_t   *archives;    /*!< Archives found in this image (owners only) */
+  nitro_image_t   *next;        /*!< Next archive of the same owner */
+  nitrofs_entry_t *mount;       /*!< Directory the archive is browsed at (archives) */
+  uint32_t        serial;       /*!< Unique number for inode numbers */
+  uint64_t        refs;         /*!< Number of references */
+  size_t          size;         /*!< NDS file size */
+  time_t          atime;        /*!< NDS file last access time */
+  time_t          mtime;        /*!< NDS file last modification time */
+  time_t          ctime;        /*!< NDS file last attribute change time */
+  dev_t           dev;          /*!< NDS file device */
+  ino_t           ino;          /*!< NDS file inode */
+  unsigned char   *mapping;     /*!< NDS file mmap address */
+  size_t          map_size;     /*!< Length of the mapping (owners only) */
+  int             fd;           /*!< NDS file descriptor (kept open for splice reads) */
+  int             populated;    /*!< Mapping is resident; skip access hints (owners only) */
+  int             copied;       /*!< Mapping is a private copy of the NDS file (owners only) */
+  uint32_t        fnt_offset;   /*!< File name table offset */
+  uint32_t        fnt_length;   /*!< File name table length */
+  uint32_t        fat_offset;   /*!< File allocation table offset */
+  uint32_t        fat_length;   /*!< File allocation table length */
+  uint32_t        data_offset;  /*!< Offset of file data, which FAT entries are relative to */
+  uint32_t        data_size;    /*!< Size of file data */
+  uint32_t        dir_count;    /*!< Number of directories in the FNT */
+  uint32_t        file_count;   /*!< Number of entries in the FAT */
+  uint8_t         *dir_claimed; /*!< Directory IDs claimed by a parent (cycle detection) */
+  uint8_t         *named;       /*!< File IDs the FNT names, once /.by-id exists (owners only) */
+  int             unnamed;      /*!< FNT names no files; name them by ID (archives) */
+  int             broken;       /*!< Tree failed to build; don't retry (archives) */
+  nitro_arena_t   arena;        /*!< Tree storage */
+  nitrofs_entry_t *root;        /*!< Root of the image's tree */
+  pthread_mutex_t lock;         /*!< Serializes lazy parsing and arena allocation */
+};
+
+/*! NDS file being served
+ *
+ *  Each NDS file is mounted at a directory: the root in single mode, or a
+ *  top-level directory in multi mode. Its current image is only loaded
+ *  when first needed in multi mode, and is replaced when the file
+ *  changes.
+ */
+struct nitro_rom_t
+{
+  char            *file;  /*!< NDS file name */
+  const char      *base;  /*!< NDS file name without its directory */
+  nitro_image_t   *image; /*!< Current image (NULL if not loaded) */
+  nitrofs_entry_t *mount; /*!< Directory the NDS file is mounted at */
+  uint64_t        pins;   /*!< Readers between loading image and taking a reference */
+  time_t          atime;  /*!< NDS file last access time (before loading) */
+  time_t          mtime;  /*!< NDS file last modification time (before loading) */
+  time_t          ctime;  /*!< NDS file last attribute change time (before loading) */
+  int             broken; /*!< The NDS file failed to load; don't retry until it changes */
+  pthread_mutex_t lock;   /*!< Serializes loading and reloading */
 };
 
-/*! Root entry */
+/*! NDS files being served */
+static nitro_rom_t *roms = NULL;
+/*! Number of NDS files being served */
+static size_t      nroms = 0;
+
+/*! Image holding the top-level directories
+ *
+ *  Its entries are the root and, in multi mode, a mount directory per NDS
+ *  file. They are built before serving and never change.
+ */
+static nitro_image_t top_image;
+
+/*! Root entry
+ *
+ *  The mappings are never modified while serving. A directory's children
+ *  are parsed once, either before the FUSE loop starts or (in lazy and
+ *  multi mode) on first use under its image's lock, and are never
+ *  modified afterwards; once nitro_load_dir has returned, every operation
+ *  reads them without locking and may run concurrently on any worker
+ *  thread. Reloading an NDS file swaps in a whole new image instead.
+ */
 static nitrofs_entry_t *root = NULL;
 
+/*! Handle for kernel cache invalidation (NULL until mounted); the
+ *  channel in FUSE 2, the session itself in FUSE 3
+ */
+#if FUSE_USE_VERSION >= 30
+static struct fuse_session *nitro_notify = NULL;
+#else
+static struct fuse_chan *nitro_notify = NULL;
+#endif
+
+/*! Command-line options */
+typedef struct
+{
+  int          lowlevel;         /*!< Serve through the low-level (inode-based) API */
+  int          splice;           /*!< Serve reads from the NDS file descriptor */
+  unsigned int threads;          /*!< Number of worker threads (0 for libfuse default) */
+  int          lazy;             /*!< Parse directories on first use */
+  char         *cache_dir;       /*!< Directory holding index cache files */
+  int          prebuild;         /*!< Build index cache files for a directory of ROMs */
+  int          multi;            /*!< Mount every NDS file in a directory */
+  double       entry_timeout;    /*!< Kernel name lookup cache timeout */
+  double       attr_timeout;     /*!< Kernel attribute cache timeout */
+  double       negative_timeout; /*!< Kernel failed lookup cache timeout */
+  int          stats;            /*!< Print upcall counters on unmount */
+  int          watch;            /*!< Reload NDS files when they change */
+  int          lz;               /*!< Present LZ77-compressed files decompressed */
+  unsigned int cache_size;       /*!< Derived data cache budget (MiB) */
+  int          narc;             /*!< Browse NARC archives as directories */
+  int          sys;              /*!< Present system files in /.sys */
+  int          by_id;            /*!< Present every FAT entry in /.by-id */
+  unsigned int max_read;         /*!< Largest read request (0 for the kernel's limit) */
+  unsigned int max_readahead;    /*!< Largest read-ahead (0 for the kernel's limit) */
+  unsigned int populate;         /*!< Prefault NDS files up to this size (MiB) */
+  int          mlock;            /*!< Lock prefaulted NDS files in memory */
+  int          hugepages;        /*!< Copy NDS files into huge pages */
+  int          preload;          /*!< Copy NDS files into memory */
+  unsigned int preload_threads;  /*!< Number of concurrent reads when copying */
+} nitro_options_t;
+
+/*! Parsed command-line options */
+static nitro_options_t nitro_opts =
+{
+  .entry_timeout    = NITRO_TIMEOUT,
+  .attr_timeout     = NITRO_TIMEOUT,
+  .negative_timeout = NITRO_TIMEOUT,
+  .cache_size       = NITRO_CACHE_SIZE,
+  .preload_threads  = NITRO_PRELOAD_THREADS,
+};
+
+/*! Upcall counters */
+typedef struct
+{
+  uint64_t lookup;  /*!< Name lookups (low-level only) */
+  uint64_t getattr; /*!< Attribute requests */
+  uint64_t opendir; /*!< Directory opens */
+  uint64_t readdir; /*!< Directory reads */
+  uint64_t open;    /*!< File opens */
+  uint64_t read;    /*!< File reads */
+  uint64_t bytes;   /*!< Bytes requested by file reads */
+  uint64_t largest; /*!< Largest file read request */
+  uint64_t ra;      /*!< Read-ahead limit agreed with the kernel */
+  uint64_t write;   /*!< Write (and FUSE 3 page) limit agreed with the kernel */
+  uint64_t lz;      /*!< LZ77 files decompressed */
+} nitro_stats_t;
+
+/*! Upcall counters, updated by every worker */
+static nitro_stats_t nitro_stats;
+
+/*! Kind of data derived from a file */
+typedef enum
+{
+  NITRO_VIEW_LZ, /*!< Decompressed LZ77 data */
+} nitro_view_t;
+
+/*! Block of derived data in the cache */
+struct nitro_block_t
+{
+  nitro_block_t       *hash_next; /*!< Pointer to next block in hash bucket */
+  nitro_block_t       *newer;     /*!< Pointer to next more recently used block */
+  nitro_block_t       *older;     /*!< Pointer to next less recently used block */
+  const nitro_image_t *image;     /*!< Image the data was derived from */
+  nitro_view_t        view;       /*!< Kind of data */
+  uint32_t            id;         /*!< File ID */
+  uint32_t            block;      /*!< Block number within the view */
+  uint32_t            hash;       /*!< Hash of the key */
+  uint64_t            refs;       /*!< Readers, plus one while in the cache */
+  size_t              size;       /*!< Size of data */
+  unsigned char       data[];     /*!< Derived data */
+};
+
+/*! Derived data cache
+ *
+ *  Shared by every image. Blocks are evicted least recently used first
+ *  once the total size exceeds the budget; a block which is being read
+ *  is only freed once its last reader releases it.
+ */
+typedef struct
+{
+  nitro_block_t   *buckets[NITRO_CACHE_BUCKETS]; /*!< Hash buckets */
+  nitro_block_t   *newest;                       /*!< Most recently used block */
+  nitro_block_t   *oldest;                       /*!< Least recently used block */
+  size_t          size;                          /*!< Total size of cached data */
+  size_t          limit;                         /*!< Budget for cached data */
+  uint64_t        hits;                          /*!< Lookups which found a block */
+  uint64_t        misses;                        /*!< Lookups which didn't */
+  uint64_t        evictions;                     /*!< Blocks evicted for space */
+  pthread_mutex_t lock;                          /*!< Protects everything above */
+} nitro_cache_t;
+
+/*! Derived data cache */
+static nitro_cache_t nitro_cache =
+{
+  .limit = (size_t)NITRO_CACHE_SIZE << 20,
+  .lock  = PTHREAD_MUTEX_INITIALIZER,
+};
+
 /*! Entry in the main FNT table */
 typedef struct
 {
@@ -94,7 +442,140 @@ typedef struct
   uint32_t end_offset;   /*!< Data end offset */
 } fat_entry_t;
 
+/*! Hash an entry name (32-bit FNV-1a)
+ *
+ *  @param[in] name Name to hash
+ *  @param[in] len  Length of name
+ *
+ *  @returns hash value
+ */
+static uint32_t
+nitro_hash_name(const char *name,
+                size_t     len)
+{
+  uint32_t hash = 2166136261u;
+
+  while(len-- > 0)
+  {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/*! Allocate a tree storage arena
+ *
+ *  Each directory needs at most twice as many buckets as it has children,
+ *  so the bucket capacity follows from the entry capacity.
+ *
+ *  @param[out] arena       Arena to allocate
+ *  @param[in]  max_entries Entry capacity
+ *  @param[in]  max_names   Name capacity
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_arena_init(nitro_arena_t *arena,
+                 size_t        max_entries,
+                 size_t        max_names)
+{
+  size_t entries_size, buckets_size;
+
+  arena->max_entries = max_entries;
+  arena->max_buckets = 2 * max_entries;
+  arena->max_names   = max_names;
+
+  entries_size = arena->max_entries * sizeof(nitrofs_entry_t);
+  buckets_size = arena->max_buckets * sizeof(nitrofs_entry_t*);
+
+  /* one zeroed, page-aligned mapping holds everything */
+  arena->size = entries_size + buckets_size + arena->max_names;
+  arena->base = mmap(NULL, arena->size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(arena->base == MAP_FAILED)
+  {
+    memset(arena, 0, sizeof(*arena));
+    return -1;
+  }
+
+  arena->entries   = (nitrofs_entry_t*)arena->base;
+  arena->buckets   = (nitrofs_entry_t**)((char*)arena->base + entries_size);
+  arena->names     = (char*)arena->base + entries_size + buckets_size;
+  arena->nentries  = 0;
+  arena->nbuckets  = 0;
+  arena->names_len = 0;
+
+  return 0;
+}
+
+/*! Allocate an entry from an arena
+ *
+ *  @param[in] arena Arena to allocate from
+ *
+ *  @returns entry
+ *  @returns NULL if the arena is exhausted
+ */
+static nitrofs_entry_t*
+nitro_alloc_entry(nitro_arena_t *arena)
+{
+  if(arena->nentries >= arena->max_entries)
+    return NULL;
+
+  return &arena->entries[arena->nentries++];
+}
+
+/*! Allocate hash buckets from an arena
+ *
+ *  @param[in] arena Arena to allocate from
+ *  @param[in] count Number of buckets
+ *
+ *  @returns zeroed buckets
+ *  @returns NULL if the arena is exhausted
+ */
+static nitrofs_entry_t**
+nitro_alloc_buckets(nitro_arena_t *arena,
+                    size_t        count)
+{
+  nitrofs_entry_t **buckets;
+
+  if(count > arena->max_buckets - arena->nbuckets)
+    return NULL;
+
+  buckets = &arena->buckets[arena->nbuckets];
+  arena->nbuckets += count;
+  return buckets;
+}
+
+/*! Copy a name into an arena
+ *
+ *  @param[in] arena Arena to allocate from
+ *  @param[in] name  Name to copy (need not be NUL-terminated)
+ *  @param[in] len   Length of name
+ *
+ *  @returns NUL-terminated copy
+ *  @returns NULL if the arena is exhausted
+ */
+static const char*
+nitro_alloc_name(nitro_arena_t *arena,
+                 const void    *name,
+                 size_t        len)
+{
+  char *copy;
+
+  if(len + 1 > arena->max_names - arena->names_len)
+    return NULL;
+
+  copy = &arena->names[arena->names_len];
+  memcpy(copy, name, len);
+  copy[len] = 0;
+  arena->names_len += len + 1;
+  return copy;
+}
+
 /*! Initialize a directory entry
+ *
+ *  The entry belongs to the same image as its parent.
  *
  *  @param[out] dir    Entry to fill
  *  @param[in]  parent Pointer to parent
@@ -107,18 +588,31 @@ nitro_init_dir(nitrofs_entry_t *dir,
 {
   dir->type      = NITRO_DIR_TYPE;
   dir->id        = id;
+  dir->offset    = 0;
   dir->size      = 0;
   dir->links     = 2; // . and ..
   dir->next      = NULL;
   dir->children  = NULL;
   dir->parent    = parent;
+  dir->hash_next = NULL;
+  dir->buckets   = NULL;
+  dir->image     = parent->image;
+  dir->rom       = NULL;
+  dir->archive   = NULL;
+  dir->sys       = 0;
+  dir->by_id     = 0;
+  dir->broken    = 0;
+  dir->nbuckets  = 0;
+  dir->nchildren = 0;
+  dir->loaded    = 0;
 }
 
 /*! Initialize a file entry
  *
- *  @param[out] file   Entry to fill
- *  @param[in]  parent Pointer to parent
- *  @param[in]  id     ID to set
+ *  @param[out] file      Entry to fill
+ *  @param[in]  parent    Pointer to parent
+ *  @param[in]  fat_entry FAT entry for this file
+ *  @param[in]  id        ID to set
  */
 static void
 nitro_init_file(nitrofs_entry_t *file,
@@ -128,434 +622,5289 @@ nitro_init_file(nitrofs_entry_t *file,
 {
   file->type      = NITRO_FILE_TYPE;
   file->id        = id;
+  file->offset    = fat_entry->start_offset;
   file->size      = fat_entry->end_offset - fat_entry->start_offset;
-  file->links     = 2; // . and ..
+  file->links     = 1;
   file->next      = NULL;
   file->children  = NULL;
   file->parent    = parent;
+  file->hash_next = NULL;
+  file->buckets   = NULL;
+  file->image     = parent->image;
+  file->rom       = NULL;
+  file->archive   = NULL;
+  file->sys       = 0;
+  file->by_id     = 0;
+  file->broken    = 0;
+  file->lz        = NITRO_LZ_UNKNOWN;
+  file->opens     = 0;
+  file->pinned    = NULL;
+  file->nbuckets  = 0;
+  file->nchildren = 0;
+  file->loaded    = 0;
 }
 
-/*! Fill a subdirectory with all of its children
+/*! Build the child hash index of a directory
  *
- *  @param[out] dir   Entry to fill
- *  @param[in]  entry FNT entry
+ *  @param[in] dir Directory to index
  *
  *  @returns 0 for success
  */
 static int
-nitro_build_subdir(nitrofs_entry_t  *dir,
-                   fnt_main_entry_t *entry)
+nitro_index_dir(nitrofs_entry_t *dir)
 {
-  nitrofs_entry_t *next, **last = &dir->children;
-  unsigned char   *p = nds_mapping + fnt_offset + entry->offset;
-  uint16_t        next_id = entry->next_id;
+  nitrofs_entry_t *child;
+  uint32_t        nbuckets = 1;
+
+  /* empty directories don't need an index */
+  if(dir->nchildren == 0)
+    return 0;
+
+  /* use a power of two with a load factor of at most 1 */
+  while(nbuckets < dir->nchildren)
+    nbuckets <<= 1;
+
+  dir->buckets = nitro_alloc_buckets(&dir->image->arena, nbuckets);
+  if(dir->buckets == NULL)
+    return -1;
+  dir->nbuckets = nbuckets;
 
-  while(*p != 0)
+  /* insert each child into its bucket */
+  for(child = dir->children; child != NULL; child = child->next)
   {
-    /* length is lower 7 bits */
-    size_t len = *p & 0x7F;
+    nitrofs_entry_t **bucket = &dir->buckets[child->hash & (nbuckets-1)];
 
-    /* allocate an entry */
-    next = (nitrofs_entry_t*)malloc(sizeof(nitrofs_entry_t)+len+1);
-    if(next == NULL)
-      return -1;
+    child->hash_next = *bucket;
+    *bucket = child;
+  }
 
-    /* copy name into entry */
-    memcpy(next->name, p+1, len);
-    next->name[len] = 0;
+  return 0;
+}
 
-    /* update 'last' */
-    *last = next;
-    last = &(*last)->next;
+/*! Build the ID index of a directory named by ID
+ *
+ *  Instead of hash buckets, such a directory has a slot for every ID in
+ *  the FAT, holding the child with that ID or NULL.
+ *
+ *  @param[in] dir Directory to index
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_index_ids(nitrofs_entry_t *dir)
+{
+  nitrofs_entry_t *child;
+  uint32_t        nids = dir->image->file_count;
 
-    if(*p & 0x80)
-    {
-      /* this is a directory entry */
-      uint16_t id;
-      fnt_main_entry_t entry;
+  if(nids == 0)
+    return 0;
 
-      /* grab the ID which immediately follows the name */
-      memcpy(&id, p + len + 1, sizeof(id));
+  dir->buckets = nitro_alloc_buckets(&dir->image->arena, nids);
+  if(dir->buckets == NULL)
+    return -1;
+  dir->nbuckets = nids;
 
-      /* initialize the directory entry */
-      nitro_init_dir(next, dir, id);
+  for(child = dir->children; child != NULL; child = child->next)
+    dir->buckets[child->id] = child;
 
-      /* update the parent stats */
-      dir->links += 1;
-      dir->size  += len + 3;
+  return 0;
+}
 
-      /* copy the FNT entry */
-      memcpy(&entry, nds_mapping + fnt_offset + ((id & NITRO_DIRMASK)*sizeof(entry)),
-             sizeof(entry));
+/*! Source of image serial numbers */
+static uint32_t nitro_serials = 0;
 
-      /* recurse */
-      if(nitro_build_subdir(next, &entry) != 0)
-        return -1;
+/*! Set up an image of an NDS file
+ *
+ *  @param[out] image Image to set up
+ *  @param[in]  file  NDS file name
+ */
+static void
+nitro_init_image(nitro_image_t *image,
+                 const char    *file)
+{
+  memset(image, 0, sizeof(*image));
+  image->file   = file;
+  image->owner  = image;
+  image->fd     = -1;
+  image->serial = __atomic_add_fetch(&nitro_serials, 1, __ATOMIC_RELAXED);
+  pthread_mutex_init(&image->lock, NULL);
+}
 
-      /* account for extra space due to ID */
-      p += 2;
-    }
-    else
-    {
-      /* this is a file entry */
-      fat_entry_t fat_entry;
+/*! Check whether a name is usable as a path component
+ *
+ *  @param[in] name Name to check (need not be NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns whether the name is valid
+ */
+static int
+nitro_valid_name(const unsigned char *name,
+                 size_t              len)
+{
+  if(len == 0)
+    return 0;
+  if(memchr(name, '/', len) != NULL || memchr(name, 0, len) != NULL)
+    return 0;
+  if(len == 1 && name[0] == '.')
+    return 0;
+  if(len == 2 && name[0] == '.' && name[1] == '.')
+    return 0;
+  return 1;
+}
 
-      /* copy the FAT entry */
-      memcpy(&fat_entry, nds_mapping + fat_offset + (next_id * sizeof(fat_entry)),
-             sizeof(fat_entry));
+/*! Count the directories and files in an image's tables
+ *
+ *  The FNT and FAT locations must already have been checked against the
+ *  mapping.
+ *
+ *  @param[in,out] image Image to check
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the FNT is invalid
+ */
+static int
+nitro_count_tables(nitro_image_t *image)
+{
+  uint16_t ndirs;
 
-      /* initialize the file entry */
-      nitro_init_file(next, dir, &fat_entry, next_id);
+  /* the FNT must at least hold the root entry */
+  if(image->fnt_length < sizeof(fnt_main_entry_t))
+    return -1;
 
-      /* update the parent stats */
-      dir->size  += len + 1;
+  /* the root FNT entry's parent ID holds the total number of directories,
+   * all of whose main entries must be inside the FNT
+   */
+  memcpy(&ndirs,
+         image->mapping + image->fnt_offset + offsetof(fnt_main_entry_t, parent_id),
+         sizeof(ndirs));
+  if(ndirs == 0 || ndirs > NITRO_DIRMASK+1
+  || ndirs > image->fnt_length / sizeof(fnt_main_entry_t))
+    return -1;
 
-      /* increment the File ID */
-      ++next_id;
-    }
+  /* file IDs are 16 bits, so FAT entries past 0xFFFF can't be named; the
+   * rest of the code (arena sizing, ID names of at most five digits)
+   * relies on this bound
+   */
+  image->dir_count  = ndirs;
+  image->file_count = image->fat_length / sizeof(fat_entry_t);
+  if(image->file_count > UINT16_MAX+1)
+    image->file_count = UINT16_MAX+1;
 
-    /* position to next entry */
-    p += len + 1;
-  }
+  return 0;
+}
+
+/*! Read a FAT entry
+ *
+ *  The extent is checked against the image's file data and made relative
+ *  to the mapping.
+ *
+ *  @param[in]  image     Image to read from
+ *  @param[in]  id        File ID
+ *  @param[out] fat_entry FAT entry to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the entry is invalid
+ */
+static int
+nitro_read_fat(nitro_image_t *image,
+               uint32_t      id,
+               fat_entry_t   *fat_entry)
+{
+  /* the file must have a FAT entry */
+  if(id >= image->file_count)
+    return -1;
+
+  /* copy the FAT entry */
+  memcpy(fat_entry,
+         image->mapping + image->fat_offset + (id * sizeof(*fat_entry)),
+         sizeof(*fat_entry));
+
+  /* the data must be inside the file data */
+  if(fat_entry->start_offset > fat_entry->end_offset
+  || fat_entry->end_offset > image->data_size)
+    return -1;
 
+  fat_entry->start_offset += image->data_offset;
+  fat_entry->end_offset   += image->data_offset;
   return 0;
 }
 
-/*! Destroy a tree
+/*! Check whether a file name has the NARC extension
+ *
+ *  @param[in] name Name to check (need not be NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns whether the name ends in .narc
+ */
+static int
+nitro_narc_name(const unsigned char *name,
+                size_t              len)
+{
+  return len > 5 && strncasecmp((const char*)name + len - 5, ".narc", 5) == 0;
+}
+
+/*! Locate the tables of a NARC archive
+ *
+ *  A NARC holds a FAT (BTAF section), an FNT (BTNF section) and the file
+ *  data the FAT is relative to (GMIF section).
+ *
+ *  @param[in,out] archive Image whose mapping holds the archive; its table
+ *                         locations and counts are filled in
+ *  @param[in]     offset  Offset of the archive in the mapping
+ *  @param[in]     size    Size of the archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the file is not a valid archive
+ */
+static int
+nitro_narc_tables(nitro_image_t *archive,
+                  uint32_t      offset,
+                  uint32_t      size)
+{
+  const unsigned char *p = archive->mapping + offset;
+  uint32_t            pos, len, btaf = 0, btnf = 0, gmif = 0;
+  uint32_t            btaf_len = 0, btnf_len = 0, gmif_len = 0;
+  uint16_t            header_len, nsections, nfiles;
+
+  if(size < NARC_HEADER_MIN || memcmp(p, "NARC", 4) != 0)
+    return -1;
+
+  memcpy(&header_len, p + 0x0C, sizeof(header_len));
+  memcpy(&nsections,  p + 0x0E, sizeof(nsections));
+
+  /* find the sections, each of which must be inside the file */
+  for(pos = header_len; nsections-- > 0; pos += len)
+  {
+    if(pos > size || size - pos < NARC_SECTION_HEADER)
+      return -1;
+
+    memcpy(&len, p + pos + 4, sizeof(len));
+    if(len < NARC_SECTION_HEADER || len > size - pos)
+      return -1;
+
+    if(memcmp(p + pos, "BTAF", 4) == 0)
+    {
+      btaf     = pos;
+      btaf_len = len;
+    }
+    else if(memcmp(p + pos, "BTNF", 4) == 0)
+    {
+      btnf     = pos;
+      btnf_len = len;
+    }
+    else if(memcmp(p + pos, "GMIF", 4) == 0)
+    {
+      gmif     = pos;
+      gmif_len = len;
+    }
+  }
+
+  /* the FAT must fit in its section */
+  if(btaf == 0 || btnf == 0 || gmif == 0 || btaf_len < NARC_BTAF_HEADER)
+    return -1;
+  memcpy(&nfiles, p + btaf + NARC_SECTION_HEADER, sizeof(nfiles));
+  if(nfiles > (btaf_len - NARC_BTAF_HEADER) / sizeof(fat_entry_t))
+    return -1;
+
+  archive->fnt_offset  = offset + btnf + NARC_SECTION_HEADER;
+  archive->fnt_length  = btnf_len - NARC_SECTION_HEADER;
+  archive->fat_offset  = offset + btaf + NARC_BTAF_HEADER;
+  archive->fat_length  = nfiles * sizeof(fat_entry_t);
+  archive->data_offset = offset + gmif + NARC_SECTION_HEADER;
+  archive->data_size   = gmif_len - NARC_SECTION_HEADER;
+
+  return nitro_count_tables(archive);
+}
+
+/*! Set up an image for a NARC archive
+ *
+ *  Its tree is only built when it is first browsed.
+ *
+ *  @param[in] file File holding the archive
+ *
+ *  @returns archive image, owned by the file's image owner
+ *  @returns NULL if the file is not a valid archive
+ */
+static nitro_image_t*
+nitro_new_archive(nitrofs_entry_t *file)
+{
+  nitro_image_t       *owner = file->image->owner;
+  nitro_image_t       *archive;
+  fnt_main_entry_t    main_entry;
+
+  archive = (nitro_image_t*)malloc(sizeof(nitro_image_t));
+  if(archive == NULL)
+    return NULL;
+
+  nitro_init_image(archive, owner->file);
+  archive->owner       = owner;
+  archive->mount       = file;
+  archive->rom         = owner->rom;
+  archive->size        = owner->size;
+  archive->atime       = owner->atime;
+  archive->mtime       = owner->mtime;
+  archive->ctime       = owner->ctime;
+  archive->mapping     = owner->mapping;
+  archive->fd          = owner->fd;
+
+  if(nitro_narc_tables(archive, file->offset, file->size) != 0)
+  {
+    pthread_mutex_destroy(&archive->lock);
+    free(archive);
+    return NULL;
+  }
+
+  /* most archives have a bare root in the FNT and no names at all */
+  memcpy(&main_entry, owner->mapping + archive->fnt_offset, sizeof(main_entry));
+  archive->unnamed = archive->dir_count == 1 && archive->file_count != 0
+                  && main_entry.offset < archive->fnt_length
+                  && owner->mapping[archive->fnt_offset + main_entry.offset] == 0;
+
+  /* the owner frees it; archives in archives may be found concurrently */
+  archive->next = __atomic_load_n(&owner->archives, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&owner->archives, &archive->next, archive, 1,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return archive;
+}
+
+/*! Fill a directory with every file in the FAT, named by ID
+ *
+ *  Used for archives without names, and for /.by-id. IDs whose FAT entry
+ *  is invalid are left out.
+ *
+ *  @param[out] dir Directory to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for allocation failure
+ */
+static int
+nitro_fill_ids(nitrofs_entry_t *dir)
+{
+  nitro_image_t   *image = dir->image;
+  nitrofs_entry_t *next, **last = &dir->children;
+  fat_entry_t     fat_entry;
+  char            name[8];
+  uint32_t        id;
+  int             len;
+
+  for(id = 0; id < image->file_count; ++id)
+  {
+    if(nitro_read_fat(image, id, &fat_entry) != 0)
+      continue;
+
+    next = nitro_alloc_entry(&image->arena);
+    if(next == NULL)
+      return -1;
+    nitro_init_file(next, dir, &fat_entry, id);
+
+    /* the same file (inode) may also have a name in the FNT */
+    if(image->named != NULL && image->named[id])
+      next->links = 2;
+
+    len = snprintf(name, sizeof(name), "%04" PRIu32, id);
+    next->name = nitro_alloc_name(&image->arena, name, len);
+    if(next->name == NULL)
+      return -1;
+    next->namelen = len;
+    next->hash    = nitro_hash_name(next->name, len);
+
+    dir->size += len + 1;
+    *last = next;
+    last = &next->next;
+    ++dir->nchildren;
+  }
+
+  return nitro_index_ids(dir);
+}
+
+/*! Read a word from the NDS header
+ *
+ *  @param[in] image  Image to read from
+ *  @param[in] offset Offset of the word
+ *
+ *  @returns value
+ *  @returns 0 if the header is too short to hold it
+ */
+static uint32_t
+nitro_header_word(nitro_image_t *image,
+                  uint32_t      offset)
+{
+  uint32_t value = 0;
+
+  if(image->size >= offset + sizeof(value))
+    memcpy(&value, image->mapping + offset, sizeof(value));
+  return value;
+}
+
+/*! Locate an overlay table
+ *
+ *  @param[in]  image  Image to read from
+ *  @param[in]  field  Header offset of the table's offset (OVT9_OFFSET or
+ *                     OVT7_OFFSET); its length follows
+ *  @param[out] offset Set to the table offset
+ *
+ *  @returns number of entries in the table
+ *  @returns 0 if the table is empty or not inside the NDS file
+ */
+static uint32_t
+nitro_overlay_table(nitro_image_t *image,
+                    uint32_t      field,
+                    uint32_t      *offset)
+{
+  uint32_t length;
+
+  *offset = nitro_header_word(image, field);
+  length  = nitro_header_word(image, field + 4);
+  if((uint64_t)*offset + length > image->size)
+    return 0;
+
+  return length / NITRO_OVERLAY_ENTRY;
+}
+
+/*! Count the entries and name bytes /.sys needs
+ *
+ *  @param[in]  image   Image to count for
+ *  @param[out] entries Set to the number of entries
+ *  @param[out] names   Set to the number of name bytes
+ */
+static void
+nitro_sys_size(nitro_image_t *image,
+               size_t        *entries,
+               size_t        *names)
+{
+  uint32_t offset, count;
+
+  count = nitro_overlay_table(image, OVT9_OFFSET, &offset)
+        + nitro_overlay_table(image, OVT7_OFFSET, &offset);
+
+  *entries = NITRO_SYS_ENTRIES + count;
+  *names   = NITRO_SYS_ENTRIES * sizeof("header.bin")
+           + count * sizeof("4294967295.bin");
+}
+
+/*! Add an entry to a directory the FNT doesn't describe
+ *
+ *  @param[in,out] dir    Directory to add to
+ *  @param[in,out] last   Link to append the entry at; advanced past it
+ *  @param[in]     name   Name of the entry
+ *  @param[in]     extent Data of a file (NULL for a directory)
+ *  @param[in]     id     ID to set
+ *
+ *  @returns entry
+ *  @returns NULL if the arena is exhausted
+ */
+static nitrofs_entry_t*
+nitro_add_entry(nitrofs_entry_t *dir,
+                nitrofs_entry_t ***last,
+                const char      *name,
+                fat_entry_t     *extent,
+                uint16_t        id)
+{
+  nitro_image_t   *image = dir->image;
+  nitrofs_entry_t *entry;
+  size_t          len = strlen(name);
+
+  entry = nitro_alloc_entry(&image->arena);
+  if(entry == NULL)
+    return NULL;
+
+  if(extent != NULL)
+  {
+    nitro_init_file(entry, dir, extent, id);
+    dir->size += len + 1;
+  }
+  else
+  {
+    nitro_init_dir(entry, dir, id);
+    dir->links += 1;
+    dir->size  += len + 3;
+  }
+
+  entry->name = nitro_alloc_name(&image->arena, name, len);
+  if(entry->name == NULL)
+    return NULL;
+  entry->namelen = len;
+  entry->hash    = nitro_hash_name(entry->name, len);
+
+  **last = entry;
+  *last  = &entry->next;
+  ++dir->nchildren;
+  return entry;
+}
+
+/*! Check whether a directory being filled already has a child
+ *
+ *  @param[in] dir  Directory to check
+ *  @param[in] name Name to look for
+ *
+ *  @returns whether the name is taken
+ */
+static int
+nitro_has_child(nitrofs_entry_t *dir,
+                const char      *name)
+{
+  nitrofs_entry_t *child;
+  size_t          len = strlen(name);
+
+  for(child = dir->children; child != NULL; child = child->next)
+  {
+    if(child->namelen == len && memcmp(child->name, name, len) == 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+/*! Add an entry to a directory in /.sys
+ *
+ *  @param[in,out] dir    Directory to add to
+ *  @param[in,out] last   Link to append the entry at; advanced past it
+ *  @param[in]     name   Name of the entry
+ *  @param[in]     extent Data of a file (NULL for a directory)
+ *  @param[in]     id     ID to set
+ *
+ *  @returns entry
+ *  @returns NULL if the arena is exhausted
+ */
+static nitrofs_entry_t*
+nitro_sys_entry(nitrofs_entry_t *dir,
+                nitrofs_entry_t ***last,
+                const char      *name,
+                fat_entry_t     *extent,
+                uint16_t        id)
+{
+  nitrofs_entry_t *entry = nitro_add_entry(dir, last, name, extent, id);
+
+  if(entry == NULL)
+    return NULL;
+
+  /* directories in /.sys are filled along with /.sys itself */
+  entry->sys    = 1;
+  entry->loaded = extent == NULL;
+  return entry;
+}
+
+/*! Add a system file to /.sys if it is inside the NDS file
+ *
+ *  @param[in,out] dir    /.sys directory
+ *  @param[in,out] last   Link to append the entry at; advanced past it
+ *  @param[in]     name   Name of the file
+ *  @param[in]     offset Offset of the file
+ *  @param[in]     size   Size of the file
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the arena is exhausted
+ */
+static int
+nitro_sys_file(nitrofs_entry_t *dir,
+               nitrofs_entry_t ***last,
+               const char      *name,
+               uint32_t        offset,
+               uint32_t        size)
+{
+  fat_entry_t extent = { offset, offset + size };
+
+  /* leave out anything the header doesn't locate */
+  if(size == 0 || (uint64_t)offset + size > dir->image->size)
+    return 0;
+
+  return nitro_sys_entry(dir, last, name, &extent, 0) != NULL ? 0 : -1;
+}
+
+/*! Fill an overlay directory in /.sys
+ *
+ *  Each overlay is named by its overlay ID. Overlays are listed in ID
+ *  order; any that aren't, or whose file isn't valid, are left out.
+ *
+ *  @param[in,out] dir   Overlay directory
+ *  @param[in]     field Header offset of the overlay table's offset
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the arena is exhausted
+ */
+static int
+nitro_fill_overlays(nitrofs_entry_t *dir,
+                    uint32_t        field)
+{
+  nitro_image_t       *image = dir->image;
+  nitrofs_entry_t     **last = &dir->children;
+  const unsigned char *p;
+  fat_entry_t         fat_entry;
+  uint32_t            offset, count, i, overlay_id, file_id, last_id = 0;
+  char                file[sizeof("4294967295.bin")];
+
+  count = nitro_overlay_table(image, field, &offset);
+  for(i = 0, p = image->mapping + offset; i < count; ++i, p += NITRO_OVERLAY_ENTRY)
+  {
+    memcpy(&overlay_id, p, sizeof(overlay_id));
+    memcpy(&file_id, p + NITRO_OVERLAY_FILE_ID, sizeof(file_id));
+
+    /* names must stay unique */
+    if(dir->nchildren != 0 && overlay_id <= last_id)
+      continue;
+    if(nitro_read_fat(image, file_id, &fat_entry) != 0)
+      continue;
+    last_id = overlay_id;
+
+    snprintf(file, sizeof(file), "%04" PRIu32 ".bin", overlay_id);
+    if(nitro_sys_entry(dir, &last, file, &fat_entry, file_id) == NULL)
+      return -1;
+  }
+
+  return nitro_index_dir(dir);
+}
+
+/*! Get the size of the banner
+ *
+ *  The banner's version determines which titles and icons it holds.
+ *
+ *  @param[in] image  Image to read from
+ *  @param[in] offset Banner offset
+ *
+ *  @returns banner size
+ */
+static uint32_t
+nitro_banner_size(nitro_image_t *image,
+                  uint32_t      offset)
+{
+  uint16_t version = 0;
+
+  if((uint64_t)offset + sizeof(version) <= image->size)
+    memcpy(&version, image->mapping + offset, sizeof(version));
+
+  switch(version)
+  {
+    case 0x0002: return 0x0940;
+    case 0x0003: return 0x0A40;
+    case 0x0103: return 0x23C0;
+    default:     return 0x0840;
+  }
+}
+
+/*! Fill /.sys
+ *
+ *  /.sys holds the parts of the NDS file outside NitroFS, located by the
+ *  header: the header itself, the ARM9 and ARM7 binaries, their overlay
+ *  tables and overlays, and the banner. Like any other file, each is a
+ *  range of the mapping.
+ *
+ *  @param[in,out] sys /.sys directory
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the arena is exhausted
+ */
+static int
+nitro_fill_sys(nitrofs_entry_t *sys)
+{
+  nitro_image_t   *image = sys->image;
+  nitrofs_entry_t *overlay9 = NULL, *overlay7 = NULL, **last = &sys->children;
+  uint32_t        banner, offset;
+
+  banner = nitro_header_word(image, BANNER_OFFSET);
+  if(nitro_sys_file(sys, &last, "header.bin", 0,
+                    image->size < NITRO_HEADER_SIZE ? image->size : NITRO_HEADER_SIZE) != 0
+  || nitro_sys_file(sys, &last, "arm9.bin",
+                    nitro_header_word(image, ARM9_OFFSET),
+                    nitro_header_word(image, ARM9_LENGTH)) != 0
+  || nitro_sys_file(sys, &last, "arm7.bin",
+                    nitro_header_word(image, ARM7_OFFSET),
+                    nitro_header_word(image, ARM7_LENGTH)) != 0
+  || nitro_sys_file(sys, &last, "y9.bin",
+                    nitro_header_word(image, OVT9_OFFSET),
+                    nitro_header_word(image, OVT9_LENGTH)) != 0
+  || nitro_sys_file(sys, &last, "y7.bin",
+                    nitro_header_word(image, OVT7_OFFSET),
+                    nitro_header_word(image, OVT7_LENGTH)) != 0
+  || (banner != 0
+   && nitro_sys_file(sys, &last, "banner.bin", banner,
+                     nitro_banner_size(image, banner)) != 0))
+    return -1;
+
+  /* every child is allocated before the overlay directories are filled,
+   * so that they stay contiguous
+   */
+  if(nitro_overlay_table(image, OVT9_OFFSET, &offset) != 0
+  && (overlay9 = nitro_sys_entry(sys, &last, "overlay9", NULL, NITRO_ROOT)) == NULL)
+    return -1;
+  if(nitro_overlay_table(image, OVT7_OFFSET, &offset) != 0
+  && (overlay7 = nitro_sys_entry(sys, &last, "overlay7", NULL, NITRO_ROOT)) == NULL)
+    return -1;
+
+  if((overlay9 != NULL && nitro_fill_overlays(overlay9, OVT9_OFFSET) != 0)
+  || (overlay7 != NULL && nitro_fill_overlays(overlay7, OVT7_OFFSET) != 0))
+    return -1;
+
+  return nitro_index_dir(sys);
+}
+
+/*! Find the file IDs which the FNT names
+ *
+ *  Walks the FNT from the root the way nitro_fill_dir parses it, without
+ *  building anything, so that a file can have the right link count
+ *  whichever of its names is parsed first. A directory nitro_fill_dir
+ *  would reject names nothing, and neither does an archive, which is a
+ *  directory of its own rather than another name of its file in /.by-id.
+ *
+ *  @param[in,out] image Image to scan
+ *
+ *  @returns 0 for success
+ *  @returns -1 for memory exhaustion
+ */
+static int
+nitro_find_named(nitro_image_t *image)
+{
+  const unsigned char *fnt = image->mapping + image->fnt_offset;
+  const unsigned char *p, *end = fnt + image->fnt_length;
+  fnt_main_entry_t    entry;
+  fat_entry_t         fat_entry;
+  nitro_image_t       archive;
+  uint16_t            *queue, id;
+  uint8_t             *claimed;
+  uint32_t            head, tail = 0, next_id;
+  size_t              len;
+  int                 pass, ok;
+
+  image->named = (uint8_t*)calloc(image->file_count + 1, sizeof(uint8_t));
+  queue        = (uint16_t*)malloc(image->dir_count * sizeof(uint16_t));
+  claimed      = (uint8_t*)calloc(image->dir_count, sizeof(uint8_t));
+  if(image->named == NULL || queue == NULL || claimed == NULL)
+  {
+    free(image->named);
+    image->named = NULL;
+    free(queue);
+    free(claimed);
+    return -1;
+  }
+
+  claimed[0]    = 1;
+  queue[tail++] = 0;
+  for(head = 0; head < tail; ++head)
+  {
+    memcpy(&entry, fnt + queue[head]*sizeof(entry), sizeof(entry));
+    if(entry.offset >= image->fnt_length)
+      continue;
+
+    /* check the whole sub-table first, then mark what it names */
+    for(pass = 0, ok = 1; ok && pass < 2; ++pass)
+    {
+      p       = fnt + entry.offset;
+      next_id = entry.next_id;
+      while(ok)
+      {
+        if(p >= end)
+        {
+          ok = 0;
+          break;
+        }
+        if(*p == 0)
+          break;
+
+        len = *p & 0x7F;
+        if(len > (size_t)(end - p - 1) || !nitro_valid_name(p+1, len))
+          ok = 0;
+        else if(*p & 0x80)
+        {
+          if((size_t)(end - p - 1 - len) < sizeof(id))
+          {
+            ok = 0;
+            break;
+          }
+          memcpy(&id, p + len + 1, sizeof(id));
+          if((id & ~NITRO_DIRMASK) != NITRO_ROOT
+          || (id & NITRO_DIRMASK) >= image->dir_count
+          || claimed[id & NITRO_DIRMASK])
+            ok = 0;
+          else if(pass == 1)
+          {
+            claimed[id & NITRO_DIRMASK] = 1;
+            queue[tail++] = id & NITRO_DIRMASK;
+          }
+          p += 2;
+        }
+        else if(nitro_read_fat(image, next_id, &fat_entry) != 0)
+          ok = 0;
+        else
+        {
+          archive.mapping = image->mapping;
+          if(pass == 1 && !(nitro_opts.narc && nitro_narc_name(p+1, len)
+                            && nitro_narc_tables(&archive, fat_entry.start_offset,
+                                                 fat_entry.end_offset - fat_entry.start_offset) == 0))
+            image->named[next_id] = 1;
+          ++next_id;
+        }
+        p += len + 1;
+      }
+    }
+  }
+
+  free(queue);
+  free(claimed);
+  return 0;
+}
+
+/*! Add /.by-id to the root of an NDS file's tree
+ *
+ *  /.by-id names every file in the FAT by its ID, including overlays and
+ *  any other file the FNT doesn't name. It is filled on first use. If the
+ *  FNT already names something .by-id, that wins. Each file the FNT names
+ *  then has two links.
+ *
+ *  @param[in,out] dir  Root directory
+ *  @param[in,out] last Link to append the entry at; advanced past it
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the arena is exhausted
+ */
+static int
+nitro_add_by_id(nitrofs_entry_t *dir,
+                nitrofs_entry_t ***last)
+{
+  nitrofs_entry_t *by_id, *child;
+
+  if(nitro_has_child(dir, ".by-id"))
+    return 0;
+
+  by_id = nitro_add_entry(dir, last, ".by-id", NULL, NITRO_ROOT);
+  if(by_id == NULL || nitro_find_named(dir->image) != 0)
+    return -1;
+  by_id->by_id = 1;
+
+  /* the root's own files were set up before /.by-id existed */
+  for(child = dir->children; child != NULL; child = child->next)
+  {
+    if(child->type == NITRO_FILE_TYPE && !child->sys && dir->image->named[child->id])
+      child->links = 2;
+  }
+
+  return 0;
+}
+
+/*! Parse the children of a directory from its FNT sub-table
+ *
+ *  Every offset and ID read from the FNT and FAT is checked against the
+ *  table bounds and the NDS file size. Each directory ID may be claimed by
+ *  only one parent, so the result is always a tree.
+ *
+ *  @param[out] dir Directory to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure (allocation failure or corrupt tables)
+ */
+static int
+nitro_fill_dir(nitrofs_entry_t *dir)
+{
+  nitro_image_t       *image = dir->image;
+  nitrofs_entry_t     *next, **last = &dir->children, *sys = NULL;
+  fnt_main_entry_t    entry;
+  const unsigned char *p, *end, *fnt;
+  uint32_t            next_id;
+
+  if(dir->by_id)
+    return nitro_fill_ids(dir);
+
+  /* copy the FNT entry; its index was checked when it was claimed */
+  fnt = image->mapping + image->fnt_offset;
+  memcpy(&entry, fnt + ((dir->id & NITRO_DIRMASK)*sizeof(entry)), sizeof(entry));
+
+  /* the sub-table must start inside the FNT */
+  if(entry.offset >= image->fnt_length)
+    return -1;
+
+  p       = fnt + entry.offset;
+  end     = fnt + image->fnt_length;
+  next_id = entry.next_id;
+
+  for(;;)
+  {
+    size_t len;
+
+    /* the length byte (or terminator) must be inside the FNT */
+    if(p >= end)
+      return -1;
+    if(*p == 0)
+      break;
+
+    /* length is lower 7 bits; the name must be inside the FNT */
+    len = *p & 0x7F;
+    if(len > (size_t)(end - p - 1) || !nitro_valid_name(p+1, len))
+      return -1;
+
+    /* allocate an entry */
+    next = nitro_alloc_entry(&image->arena);
+    if(next == NULL)
+      return -1;
+
+    if(*p & 0x80)
+    {
+      /* this is a directory entry */
+      uint16_t id;
+
+      /* grab the ID which immediately follows the name */
+      if((size_t)(end - p - 1 - len) < sizeof(id))
+        return -1;
+      memcpy(&id, p + len + 1, sizeof(id));
+
+      /* the ID must name a directory other than the root which no other
+       * directory has claimed; this rules out cycles
+       */
+      if((id & ~NITRO_DIRMASK) != NITRO_ROOT
+      || (id & NITRO_DIRMASK) >= image->dir_count
+      || image->dir_claimed[id & NITRO_DIRMASK])
+        return -1;
+      image->dir_claimed[id & NITRO_DIRMASK] = 1;
+
+      /* initialize the directory entry */
+      nitro_init_dir(next, dir, id);
+
+      /* update the parent stats */
+      dir->links += 1;
+      dir->size  += len + 3;
+    }
+    else
+    {
+      /* this is a file entry */
+      fat_entry_t fat_entry;
+
+      /* the file must have a valid FAT entry */
+      if(nitro_read_fat(image, next_id, &fat_entry) != 0)
+        return -1;
+
+      /* initialize the file entry */
+      nitro_init_file(next, dir, &fat_entry, next_id);
+
+      /* an archive becomes a directory, browsed once it is first used */
+      if(nitro_opts.narc && nitro_narc_name(p+1, len)
+      && (next->archive = nitro_new_archive(next)) != NULL)
+      {
+        next->type   = NITRO_DIR_TYPE;
+        next->loaded = 1;
+        dir->links  += 1;
+      }
+      /* otherwise it is also named in /.by-id, if that exists */
+      else if(image->named != NULL && image->named[next_id])
+        next->links = 2;
+
+      /* update the parent stats */
+      dir->size  += len + 1;
+
+      /* increment the File ID */
+      ++next_id;
+    }
+
+    /* copy name into entry */
+    next->name = nitro_alloc_name(&image->arena, p+1, len);
+    if(next->name == NULL)
+      return -1;
+    next->namelen = len;
+    next->hash    = nitro_hash_name(next->name, len);
+
+    /* update 'last' */
+    *last = next;
+    last = &(*last)->next;
+    ++dir->nchildren;
+
+    /* position to next entry; directories have an extra ID */
+    if(*p & 0x80)
+      p += 2;
+    p += len + 1;
+  }
+
+  /* the root (its own parent) of an NDS file, but not of an archive, also
+   * holds /.sys and /.by-id, unless the FNT already names them
+   */
+  if(dir->parent == dir && image->owner == image)
+  {
+    if(nitro_opts.sys && !nitro_has_child(dir, ".sys")
+    && (sys = nitro_sys_entry(dir, &last, ".sys", NULL, NITRO_ROOT)) == NULL)
+      return -1;
+    if(nitro_opts.by_id && nitro_add_by_id(dir, &last) != 0)
+      return -1;
+
+    /* /.sys is filled once every child of the root is allocated */
+    if(sys != NULL && nitro_fill_sys(sys) != 0)
+      return -1;
+  }
+
+  /* index the children for lookups */
+  return nitro_index_dir(dir);
+}
+
+/*! Parse a directory's children and publish them
+ *
+ *  The caller must hold the image lock, or otherwise be the only thread
+ *  which can reach the image.
+ *
+ *  @param[in] dir Directory to parse
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_parse_dir(nitrofs_entry_t *dir)
+{
+  /* a failed parse is not retried; each attempt would take more of the
+   * arena and fail again
+   */
+  if(dir->broken)
+    return -1;
+
+  if(nitro_fill_dir(dir) != 0)
+  {
+    /* forget whatever was partially parsed */
+    dir->children  = NULL;
+    dir->buckets   = NULL;
+    dir->nbuckets  = 0;
+    dir->nchildren = 0;
+    dir->size      = 0;
+    dir->links     = 2;
+    dir->broken    = 1;
+    return -1;
+  }
+
+  __atomic_store_n(&dir->loaded, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*! Make sure a directory's children have been parsed
+ *
+ *  Safe to call concurrently; the first caller parses the directory and
+ *  the rest wait for it.
+ *
+ *  @param[in] dir Directory to load
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_load_dir(nitrofs_entry_t *dir)
+{
+  nitro_image_t *image = dir->image;
+  int           rc = 0;
+
+  /* fast path; already parsed */
+  if(__atomic_load_n(&dir->loaded, __ATOMIC_ACQUIRE))
+    return 0;
+
+  pthread_mutex_lock(&image->lock);
+  if(!dir->loaded)
+    rc = nitro_parse_dir(dir);
+  pthread_mutex_unlock(&image->lock);
+
+  return rc;
+}
+
+/*! Parse a directory and all of its descendants
+ *
+ *  Uses an explicit stack rather than recursion, so deep trees cannot
+ *  overflow the call stack. Since every directory is claimed by exactly
+ *  one parent, at most dir_count directories are ever pushed, plus
+ *  /.by-id. Like nitro_parse_dir, this needs exclusive access to the
+ *  image.
+ *
+ *  @param[in] dir Directory to fill
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_build_subdirs(nitrofs_entry_t *dir)
+{
+  nitrofs_entry_t **stack, *child;
+  uint32_t        dir_count = dir->image->dir_count + 1;
+  size_t          depth = 0;
+  int             rc = 0;
+
+  stack = (nitrofs_entry_t**)malloc(dir_count * sizeof(nitrofs_entry_t*));
+  if(stack == NULL)
+    return -1;
+
+  stack[depth++] = dir;
+  while(rc == 0 && depth > 0)
+  {
+    dir = stack[--depth];
+
+    /* all of a directory's children are allocated together, before any of
+     * its subdirectories are filled, so that they stay contiguous
+     */
+    if(!dir->loaded && nitro_parse_dir(dir) != 0)
+    {
+      rc = -1;
+      break;
+    }
+
+    for(child = dir->children; child != NULL; child = child->next)
+    {
+      /* archives have trees of their own, and /.sys is already filled */
+      if(child->type != NITRO_DIR_TYPE || child->loaded)
+        continue;
+
+      if(depth >= dir_count)
+      {
+        rc = -1;
+        break;
+      }
+      stack[depth++] = child;
+    }
+  }
+
+  free(stack);
+  return rc;
+}
+
+/*! Hash a block of memory (64-bit FNV-1a)
+ *
+ *  @param[in] data Data to hash
+ *  @param[in] len  Length of data
+ *
+ *  @returns hash value
+ */
+static uint64_t
+nitro_hash64(const void *data,
+             size_t     len)
+{
+  const unsigned char *p = (const unsigned char*)data;
+  uint64_t            hash = 14695981039346656037ull;
+
+  while(len-- > 0)
+  {
+    hash ^= *p++;
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+/*! Hash a derived data cache key
+ *
+ *  @param[in] image Image the data is derived from
+ *  @param[in] view  Kind of data
+ *  @param[in] id    File ID
+ *  @param[in] block Block number
+ *
+ *  @returns hash value
+ */
+static uint32_t
+nitro_cache_hash(const nitro_image_t *image,
+                 nitro_view_t        view,
+                 uint32_t            id,
+                 uint32_t            block)
+{
+  uint64_t key[3] = { (uintptr_t)image, ((uint64_t)view << 32) | id, block };
+
+  return (uint32_t)nitro_hash64(key, sizeof(key));
+}
+
+/*! Unlink a block from the recently used list
+ *
+ *  The cache lock must be held.
+ *
+ *  @param[in] blk Block to unlink
+ */
+static void
+nitro_cache_unlink(nitro_block_t *blk)
+{
+  if(blk->newer != NULL)
+    blk->newer->older = blk->older;
+  else
+    nitro_cache.newest = blk->older;
+
+  if(blk->older != NULL)
+    blk->older->newer = blk->newer;
+  else
+    nitro_cache.oldest = blk->newer;
+
+  blk->newer = blk->older = NULL;
+}
+
+/*! Link a block as the most recently used
+ *
+ *  The cache lock must be held.
+ *
+ *  @param[in] blk Block to link
+ */
+static void
+nitro_cache_link(nitro_block_t *blk)
+{
+  blk->older = nitro_cache.newest;
+  blk->newer = NULL;
+  if(nitro_cache.newest != NULL)
+    nitro_cache.newest->newer = blk;
+  else
+    nitro_cache.oldest = blk;
+  nitro_cache.newest = blk;
+}
+
+/*! Release a block obtained from the cache
+ *
+ *  @param[in] blk Block to release (may be NULL)
+ */
+static void
+nitro_cache_release(nitro_block_t *blk)
+{
+  if(blk != NULL && __atomic_sub_fetch(&blk->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(blk);
+}
+
+/*! Remove a block from the cache
+ *
+ *  The cache lock must be held. Readers may keep using the block until
+ *  they release it.
+ *
+ *  @param[in] blk Block to remove
+ */
+static void
+nitro_cache_remove(nitro_block_t *blk)
+{
+  nitro_block_t **p = &nitro_cache.buckets[blk->hash & (NITRO_CACHE_BUCKETS-1)];
+
+  while(*p != blk)
+    p = &(*p)->hash_next;
+  *p = blk->hash_next;
+
+  nitro_cache_unlink(blk);
+  nitro_cache.size -= blk->size;
+  nitro_cache_release(blk);
+}
+
+/*! Allocate a block for derived data
+ *
+ *  The caller fills in the data and passes it to nitro_cache_insert.
+ *
+ *  @param[in] image Image the data is derived from
+ *  @param[in] view  Kind of data
+ *  @param[in] id    File ID
+ *  @param[in] block Block number
+ *  @param[in] size  Size of data
+ *
+ *  @returns new block
+ *  @returns NULL for failure
+ */
+static nitro_block_t*
+nitro_cache_alloc(const nitro_image_t *image,
+                  nitro_view_t        view,
+                  uint32_t            id,
+                  uint32_t            block,
+                  size_t              size)
+{
+  nitro_block_t *blk = (nitro_block_t*)malloc(sizeof(nitro_block_t) + size);
+
+  if(blk == NULL)
+    return NULL;
+
+  memset(blk, 0, sizeof(*blk));
+  blk->image = image;
+  blk->view  = view;
+  blk->id    = id;
+  blk->block = block;
+  blk->hash  = nitro_cache_hash(image, view, id, block);
+  blk->refs  = 1;
+  blk->size  = size;
+  return blk;
+}
+
+/*! Look up a block in the cache
+ *
+ *  @param[in] image Image the data is derived from
+ *  @param[in] view  Kind of data
+ *  @param[in] id    File ID
+ *  @param[in] block Block number
+ *
+ *  @returns block, which the caller must release
+ *  @returns NULL if the block isn't cached
+ */
+static nitro_block_t*
+nitro_cache_get(const nitro_image_t *image,
+                nitro_view_t        view,
+                uint32_t            id,
+                uint32_t            block)
+{
+  nitro_block_t *blk;
+  uint32_t      hash = nitro_cache_hash(image, view, id, block);
+
+  pthread_mutex_lock(&nitro_cache.lock);
+
+  for(blk = nitro_cache.buckets[hash & (NITRO_CACHE_BUCKETS-1)];
+      blk != NULL;
+      blk = blk->hash_next)
+  {
+    if(blk->hash == hash && blk->image == image && blk->view == view
+    && blk->id == id && blk->block == block)
+      break;
+  }
+
+  if(blk != NULL)
+  {
+    /* move it to the front of the recently used list */
+    nitro_cache_unlink(blk);
+    nitro_cache_link(blk);
+    __atomic_fetch_add(&blk->refs, 1, __ATOMIC_RELAXED);
+    ++nitro_cache.hits;
+  }
+  else
+    ++nitro_cache.misses;
+
+  pthread_mutex_unlock(&nitro_cache.lock);
+  return blk;
+}
+
+/*! Add a filled block to the cache
+ *
+ *  Older blocks are evicted to stay within the budget. A block larger than
+ *  the whole budget is not cached at all, and if another reader cached the
+ *  same block first, that one is used instead.
+ *
+ *  @param[in] blk Block from nitro_cache_alloc
+ *
+ *  @returns block to read, which the caller must release
+ */
+static nitro_block_t*
+nitro_cache_insert(nitro_block_t *blk)
+{
+  nitro_block_t **bucket = &nitro_cache.buckets[blk->hash & (NITRO_CACHE_BUCKETS-1)];
+  nitro_block_t *other;
+
+  if(blk->size > nitro_cache.limit)
+    return blk;
+
+  pthread_mutex_lock(&nitro_cache.lock);
+
+  for(other = *bucket; other != NULL; other = other->hash_next)
+  {
+    if(other->hash == blk->hash && other->image == blk->image
+    && other->view == blk->view && other->id == blk->id
+    && other->block == blk->block)
+    {
+      __atomic_fetch_add(&other->refs, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&nitro_cache.lock);
+      free(blk);
+      return other;
+    }
+  }
+
+  /* make room */
+  while(nitro_cache.size + blk->size > nitro_cache.limit)
+  {
+    nitro_cache_remove(nitro_cache.oldest);
+    ++nitro_cache.evictions;
+  }
+
+  /* the cache holds a reference of its own */
+  blk->refs      += 1;
+  blk->hash_next  = *bucket;
+  *bucket         = blk;
+  nitro_cache_link(blk);
+  nitro_cache.size += blk->size;
+
+  pthread_mutex_unlock(&nitro_cache.lock);
+  return blk;
+}
+
+/*! Remove every block derived from an image
+ *
+ *  @param[in] image Image being freed
+ */
+static void
+nitro_cache_drop(const nitro_image_t *image)
+{
+  nitro_block_t *blk, *older;
+
+  pthread_mutex_lock(&nitro_cache.lock);
+
+  for(blk = nitro_cache.newest; blk != NULL; blk = older)
+  {
+    older = blk->older;
+    if(blk->image == image)
+      nitro_cache_remove(blk);
+  }
+
+  pthread_mutex_unlock(&nitro_cache.lock);
+}
+
+/*! Destroy an image's tree
+ *
+ *  @param[in] image Image to clean up
+ */
+static void
+nitro_destroy_tree(nitro_image_t *image)
+{
+  nitro_image_t *archive;
+
+  /* archives found in the image go with it */
+  while((archive = image->archives) != NULL)
+  {
+    image->archives = archive->next;
+    nitro_cache_drop(archive);
+    nitro_destroy_tree(archive);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive);
+  }
+
+  /* everything lives in the arena */
+  if(image->arena.size != 0)
+    munmap(image->arena.base, image->arena.size);
+  memset(&image->arena, 0, sizeof(image->arena));
+  free(image->dir_claimed);
+  image->dir_claimed = NULL;
+  free(image->named);
+  image->named = NULL;
+  image->root = NULL;
+}
+
+/*! Read and validate the FNT and FAT locations from the header
+ *
+ *  @param[in,out] image Mapped image
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the tables do not fit in the NDS file
+ */
+static int
+nitro_read_header(nitro_image_t *image)
+{
+  if(image->size < NITRO_HEADER_MIN)
+    return -1;
+
+  memcpy(&image->fnt_offset, image->mapping + FNT_OFFSET, sizeof(image->fnt_offset));
+  memcpy(&image->fnt_length, image->mapping + FNT_LENGTH, sizeof(image->fnt_length));
+  memcpy(&image->fat_offset, image->mapping + FAT_OFFSET, sizeof(image->fat_offset));
+  memcpy(&image->fat_length, image->mapping + FAT_LENGTH, sizeof(image->fat_length));
+
+  /* both tables must be inside the NDS file */
+  if((uint64_t)image->fnt_offset + image->fnt_length > image->size
+  || (uint64_t)image->fat_offset + image->fat_length > image->size)
+    return -1;
+
+  /* FAT entries are relative to the start of the NDS file */
+  image->data_offset = 0;
+  image->data_size   = image->size > UINT32_MAX ? UINT32_MAX : image->size;
+
+  return nitro_count_tables(image);
+}
+
+/*! Build an image's tree
+ *
+ *  @param[in,out] image Mapped image
+ *  @param[in]     lazy  Only set up the root; parse directories on first use
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_build_tree(nitro_image_t *image,
+                 int           lazy)
+{
+  nitrofs_entry_t *root;
+  size_t          entries = image->dir_count + image->file_count;
+  size_t          names = image->fnt_length + 1;
+  size_t          sys_entries, sys_names;
+
+  /* allocate storage for the whole tree; every file has a FAT entry and
+   * every name fits in the FNT, or is a file ID of at most five digits
+   */
+  if(image->unnamed)
+    names += image->file_count * sizeof("65535");
+  if(nitro_opts.sys && image->owner == image)
+  {
+    nitro_sys_size(image, &sys_entries, &sys_names);
+    entries += sys_entries;
+    names   += sys_names;
+  }
+  if(nitro_opts.by_id && image->owner == image)
+  {
+    entries += 1 + image->file_count;
+    names   += sizeof(".by-id") + image->file_count * sizeof("65535");
+  }
+  if(nitro_arena_init(&image->arena, entries, names) != 0)
+    return -1;
+
+  /* allocate root node and cycle detection state */
+  image->dir_claimed = (uint8_t*)calloc(image->dir_count, sizeof(uint8_t));
+  root = nitro_alloc_entry(&image->arena);
+  if(image->dir_claimed == NULL || root == NULL)
+  {
+    nitro_destroy_tree(image);
+    return -1;
+  }
+
+  /* initialize root directory; nothing else may claim it */
+  root->image = image;
+  nitro_init_dir(root, root, NITRO_ROOT);
+  image->dir_claimed[0] = 1;
+  root->by_id   = image->unnamed;
+  root->name    = nitro_alloc_name(&image->arena, "", 0);
+  root->namelen = 0;
+  root->hash    = nitro_hash_name(root->name, 0);
+
+  /* in lazy mode, directories are parsed on first use; otherwise fill in
+   * the whole tree
+   */
+  if(!lazy && nitro_build_subdirs(root) != 0)
+  {
+    /* a failure; clean up */
+    nitro_destroy_tree(image);
+    return -1;
+  }
+
+  /* archives are built while they may already be being looked up */
+  __atomic_store_n(&image->root, root, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*! Give the kernel a hint about part of an image's mapping
+ *
+ *  @param[in] image  Image whose mapping to advise
+ *  @param[in] offset Offset of the range
+ *  @param[in] length Length of the range
+ *  @param[in] advice madvise advice
+ */
+static void
+nitro_advise(nitro_image_t *image,
+             size_t        offset,
+             size_t        length,
+             int           advice)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = offset & ~(page - 1);
+
+  /* advice is only a hint, so failure doesn't matter */
+  if(length != 0)
+    madvise(image->mapping + start, offset - start + length, advice);
+}
+
+/*! Mark an image's tables as randomly accessed
+ *
+ *  Lookups jump around the header, FNT and FAT, so reading around a
+ *  fault there only pulls in file data nobody asked for. The hint has
+ *  to cover whole pages, and so may spill onto neighbouring data.
+ *
+ *  @param[in] image Image whose header has been read
+ */
+static void
+nitro_advise_tables(nitro_image_t *image)
+{
+  if(image->populated)
+    return;
+
+  nitro_advise(image, 0, NITRO_HEADER_SIZE, MADV_RANDOM);
+  nitro_advise(image, image->fnt_offset, image->fnt_length, MADV_RANDOM);
+  nitro_advise(image, image->fat_offset, image->fat_length, MADV_RANDOM);
+}
+
+/*! Allocate memory backed by huge pages where possible
+ *
+ *  Huge pages set aside by the administrator (MAP_HUGETLB) are used if
+ *  there are enough; otherwise the memory is aligned for, and advised to
+ *  use, transparent huge pages.
+ *
+ *  @param[in]  size   Size to allocate
+ *  @param[out] length Length of the mapping to pass to munmap
+ *
+ *  @returns memory (read-write)
+ *  @returns NULL for failure
+ */
+static unsigned char*
+nitro_alloc_huge(size_t size,
+                 size_t *length)
+{
+  size_t        len = (size + NITRO_HUGE_PAGE - 1) & ~(size_t)(NITRO_HUGE_PAGE - 1);
+  unsigned char *p, *aligned;
+
+  p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if(p != MAP_FAILED)
+  {
+    *length = len;
+    return p;
+  }
+
+  /* transparent huge pages need huge page aligned addresses, so map an
+   * extra page and trim either side
+   */
+  p = mmap(NULL, len + NITRO_HUGE_PAGE, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    return NULL;
+
+  aligned = (unsigned char*)(((uintptr_t)p + NITRO_HUGE_PAGE - 1)
+                             & ~(uintptr_t)(NITRO_HUGE_PAGE - 1));
+  if(aligned != p)
+    munmap(p, aligned - p);
+  munmap(aligned + len, p + NITRO_HUGE_PAGE - aligned);
+
+  madvise(aligned, len, MADV_HUGEPAGE);
+  *length = len;
+  return aligned;
+}
+
+/*! Read part of an NDS file
+ *
+ *  @param[in]  fd     NDS file descriptor
+ *  @param[out] dst    Buffer to fill
+ *  @param[in]  size   Size to read
+ *  @param[in]  offset Offset to start at
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_pread(int           fd,
+            unsigned char *dst,
+            size_t        size,
+            size_t        offset)
+{
+  size_t  done = 0;
+  ssize_t rc;
+
+  while(done < size)
+  {
+    rc = pread(fd, dst + done, size - done, offset + done);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+    {
+      /* the file shrank under us */
+      if(rc == 0)
+        errno = EIO;
+      return -1;
+    }
+    done += rc;
+  }
+
+  return 0;
+}
+
+/*! NDS file copy shared by its readers */
+typedef struct
+{
+  int           fd;    /*!< NDS file descriptor */
+  unsigned char *dst;  /*!< Buffer to fill */
+  size_t        size;  /*!< NDS file size */
+  size_t        next;  /*!< Offset of the next chunk to read */
+  int           error; /*!< errno of the first failed read (0 if none) */
+} nitro_preload_t;
+
+/*! Copy chunks of an NDS file until none are left
+ *
+ *  @param[in] arg NDS file copy
+ *
+ *  @returns NULL
+ */
+static void*
+nitro_preload_worker(void *arg)
+{
+  nitro_preload_t *job = (nitro_preload_t*)arg;
+  size_t          offset, size;
+  int             none = 0;
+
+  while(__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0)
+  {
+    offset = __atomic_fetch_add(&job->next, NITRO_PRELOAD_CHUNK, __ATOMIC_RELAXED);
+    if(offset >= job->size)
+      break;
+
+    size = job->size - offset;
+    if(size > NITRO_PRELOAD_CHUNK)
+      size = NITRO_PRELOAD_CHUNK;
+
+    if(nitro_pread(job->fd, job->dst + offset, size, offset) != 0)
+    {
+      __atomic_compare_exchange_n(&job->error, &none, errno, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*! Read all of an NDS file
+ *
+ *  The file is read in large chunks by several threads at once, which
+ *  keeps slow or distant storage busy instead of waiting out each round
+ *  trip in turn.
+ *
+ *  @param[in]  fd   NDS file descriptor
+ *  @param[out] dst  Buffer to fill
+ *  @param[in]  size NDS file size
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_read_rom(int           fd,
+               unsigned char *dst,
+               size_t        size)
+{
+  nitro_preload_t job = { .fd = fd, .dst = dst, .size = size, };
+  pthread_t       *threads;
+  size_t          chunks = (size + NITRO_PRELOAD_CHUNK - 1) / NITRO_PRELOAD_CHUNK;
+  unsigned int    nthreads = nitro_opts.preload_threads, i, started;
+
+  if(nthreads > chunks)
+    nthreads = chunks;
+
+  /* this thread reads too, so it is fine if no helper starts */
+  threads = nthreads > 1 ? (pthread_t*)calloc(nthreads - 1, sizeof(pthread_t)) : NULL;
+  for(started = 0; threads != NULL && started < nthreads - 1; ++started)
+  {
+    if(pthread_create(&threads[started], NULL, nitro_preload_worker, &job) != 0)
+      break;
+  }
+
+  nitro_preload_worker(&job);
+  for(i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if(job.error != 0)
+  {
+    errno = job.error;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! Copy an image's NDS file into memory
+ *
+ *  The copy goes into huge pages with -o hugepages, and ordinary
+ *  anonymous memory otherwise.
+ *
+ *  @param[in,out] image Image to load
+ *  @param[in]     fd    NDS file descriptor
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_copy_rom(nitro_image_t *image,
+               int           fd)
+{
+  struct timespec start, end;
+  unsigned char   *mem;
+  size_t          length = image->size;
+  double          secs;
+
+  if(nitro_opts.hugepages)
+    mem = nitro_alloc_huge(image->size, &length);
+  else
+  {
+    mem = mmap(NULL, length, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+      mem = NULL;
+  }
+  if(mem == NULL)
+  {
+    perror("mmap");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(nitro_read_rom(fd, mem, image->size) != 0)
+  {
+    perror("read");
+    munmap(mem, length);
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%s: loaded %zu bytes in %.3f s (%.1f MiB/s)\n",
+          image->file, image->size, secs,
+          secs > 0 ? image->size / secs / (1 << 20) : 0.0);
+
+  /* serve it read-only, like the file mapping */
+  mprotect(mem, length, PROT_READ);
+
+  image->mapping  = mem;
+  image->map_size = length;
+  return 0;
+}
+
+/*! Open and map an image's NDS file
+ *
+ *  @param[in,out] image Image to map
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_map_rom(nitro_image_t *image)
+{
+  struct stat st;
+  int         fd, flags = MAP_PRIVATE;
+
+  /* open the nds file */
+  fd = open(image->file, O_RDONLY);
+  if(fd < 0)
+  {
+    perror("open");
+    return -1;
+  }
+
+  /* get the file information */
+  if(fstat(fd, &st) != 0)
+  {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  /* set up data about the nds file */
+  image->size  = st.st_size;
+  image->atime = st.st_atime;
+  image->mtime = st.st_mtime;
+  image->ctime = st.st_ctime;
+  image->dev   = st.st_dev;
+  image->ino   = st.st_ino;
+
+  /* copy the nds file into memory, or map it if that fails */
+  image->copied    = (nitro_opts.preload || nitro_opts.hugepages)
+                  && nitro_copy_rom(image, fd) == 0;
+  image->populated = image->copied;
+  if(!image->populated)
+  {
+    /* small nds files can be read in whole up front */
+    image->populated = nitro_opts.populate != 0
+                    && (uint64_t)st.st_size <= (uint64_t)nitro_opts.populate << 20;
+    if(image->populated)
+      flags |= MAP_POPULATE;
+
+    image->mapping = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+    if(image->mapping == MAP_FAILED)
+    {
+      perror("mmap");
+      image->mapping = NULL;
+      close(fd);
+      return -1;
+    }
+    image->map_size = st.st_size;
+  }
+
+  /* failing to lock only costs latency, so keep going */
+  if(image->populated && nitro_opts.mlock
+  && mlock(image->mapping, image->map_size) != 0)
+    perror("mlock");
+
+  /* file data is read front to back, one file at a time */
+  if(!image->populated)
+    madvise(image->mapping, st.st_size, MADV_SEQUENTIAL);
+  if(nitro_opts.splice)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  /* splice mode reads from the file; otherwise the mapping is enough */
+  if(nitro_opts.splice)
+    image->fd = fd;
+  else
+    close(fd);
+
+  return 0;
+}
+
+/*! Unmap an image's NDS file
+ *
+ *  @param[in,out] image Image to unmap
+ */
+static void
+nitro_unmap_rom(nitro_image_t *image)
+{
+  if(image->mapping != NULL)
+    munmap(image->mapping, image->map_size);
+  image->mapping = NULL;
+  if(image->fd >= 0)
+    close(image->fd);
+  image->fd = -1;
+}
+
+/*! Index cache file magic */
+#define NITRO_INDEX_MAGIC   "NITROIDX"
+
+/*! Index cache file format version */
+#define NITRO_INDEX_VERSION 4
+
+/*! Index cache flag: NARC archives are directories */
+#define NITRO_INDEX_NARC  0x01
+/*! Index cache flag: the root holds /.sys */
+#define NITRO_INDEX_SYS   0x02
+/*! Index cache flag: the root holds /.by-id */
+#define NITRO_INDEX_BY_ID 0x04
+
+/*! Index cache file header
+ *
+ *  The header is followed, at data_offset, by an image of the tree arena
+ *  as it was laid out in memory when the index was written. Pointers in
+ *  the image hold the addresses they had then (relative to base); if the
+ *  image cannot be mapped at the same address, they are relocated.
+ */
+typedef struct
+{
+  char     magic[8];       /*!< NITRO_INDEX_MAGIC */
+  uint32_t version;        /*!< NITRO_INDEX_VERSION */
+  uint32_t entry_size;     /*!< Size of nitrofs_entry_t */
+  uint32_t flags;          /*!< Options the tree was built with (NITRO_INDEX_*) */
+  uint64_t rom_size;       /*!< NDS file size */
+  int64_t  rom_mtime;      /*!< NDS file modification time */
+  uint64_t header_hash;    /*!< Hash of the NDS header */
+  uint64_t base;           /*!< Arena address when written */
+  uint64_t data_offset;    /*!< File offset of the arena image */
+  uint64_t arena_size;     /*!< Size of the arena image */
+  uint64_t buckets;        /*!< Offset of bucket storage in the image */
+  uint64_t names;          /*!< Offset of name storage in the image */
+  uint64_t nentries;       /*!< Number of entries */
+  uint64_t nbuckets;       /*!< Number of buckets */
+  uint64_t names_len;      /*!< Number of name bytes */
+  char     path[PATH_MAX]; /*!< Absolute path of the NDS file */
+} nitro_index_header_t;
+
+/*! Fill in the index header fields which identify a mapped NDS file
+ *
+ *  @param[in]  image Mapped image
+ *  @param[out] hdr   Header to fill
+ *  @param[in]  path  Absolute path of the NDS file
+ */
+static void
+nitro_index_key(nitro_image_t        *image,
+                nitro_index_header_t *hdr,
+                const char           *path)
+{
+  size_t header_len = image->size < 0x200 ? image->size : 0x200;
+
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, NITRO_INDEX_MAGIC, sizeof(hdr->magic));
+  hdr->version     = NITRO_INDEX_VERSION;
+  hdr->entry_size  = sizeof(nitrofs_entry_t);
+  hdr->flags       = (nitro_opts.narc  ? NITRO_INDEX_NARC  : 0)
+                   | (nitro_opts.sys   ? NITRO_INDEX_SYS   : 0)
+                   | (nitro_opts.by_id ? NITRO_INDEX_BY_ID : 0);
+  hdr->rom_size    = image->size;
+  hdr->rom_mtime   = image->mtime;
+  hdr->header_hash = nitro_hash64(image->mapping, header_len);
+  strncpy(hdr->path, path, sizeof(hdr->path)-1);
+}
+
+/*! Get the index cache file name for the NDS file
+ *
+ *  @param[in] path Absolute path of the NDS file
+ *
+ *  @returns allocated file name
+ *  @returns NULL for failure
+ */
+static char*
+nitro_index_file(const char *path)
+{
+  char   *file;
+  size_t len = strlen(nitro_opts.cache_dir) + sizeof("/0123456789abcdef.idx");
+
+  file = (char*)malloc(len);
+  if(file == NULL)
+    return NULL;
+
+  snprintf(file, len, "%s/%016" PRIx64 ".idx", nitro_opts.cache_dir,
+           nitro_hash64(path, strlen(path)));
+  return file;
+}
+
+/*! Check and relocate a pointer from an index image
+ *
+ *  @param[in,out] ptr   Pointer to relocate
+ *  @param[in]     lo    Start of the region it must point into
+ *  @param[in]     hi    End of the region it must point into
+ *  @param[in]     align Size of the elements of the region
+ *  @param[in]     delta Distance the image has moved
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the pointer is out of range
+ */
+static int
+nitro_index_reloc(void      *ptr,
+                  uintptr_t lo,
+                  uintptr_t hi,
+                  size_t    align,
+                  uintptr_t delta)
+{
+  uintptr_t value;
+
+  memcpy(&value, ptr, sizeof(value));
+  if(value == 0)
+    return 0;
+  if(value < lo || value >= hi || (value - lo) % align != 0)
+    return -1;
+
+  /* only write if it moved, so an unmoved image stays clean */
+  if(delta != 0)
+  {
+    value += delta;
+    memcpy(ptr, &value, sizeof(value));
+  }
+  return 0;
+}
+
+/*! Check a directory's lookup index from an index image
+ *
+ *  Every bucket slot must hold a child of the directory (or NULL). Hash
+ *  chains may only link children hashed into the same bucket, and may be
+ *  no longer than the directory, so a corrupt index can't send a lookup
+ *  out of range or around a cycle.
+ *
+ *  @param[in] arena Arena holding the relocated image
+ *  @param[in] dir   Directory to check
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the index is invalid
+ */
+static int
+nitro_index_check_dir(nitro_arena_t   *arena,
+                      nitrofs_entry_t *dir)
+{
+  nitrofs_entry_t *entry, *first = dir->children, *last = first + dir->nchildren;
+  uint32_t        i, steps;
+
+  if(dir->nbuckets == 0)
+    return 0;
+
+  /* the buckets must be inside bucket storage */
+  if(dir->buckets == NULL
+  || dir->nbuckets > (size_t)(&arena->buckets[arena->nbuckets] - dir->buckets))
+    return -1;
+
+  /* directories named by ID have a slot for every ID in the FAT */
+  if(dir->by_id)
+  {
+    for(i = 0; i < dir->nbuckets; ++i)
+    {
+      entry = dir->buckets[i];
+      if(entry != NULL && (entry < first || entry >= last || entry->id != i))
+        return -1;
+    }
+    return 0;
+  }
+
+  /* hashed directories have a power of two of buckets */
+  if((dir->nbuckets & (dir->nbuckets-1)) != 0)
+    return -1;
+
+  for(i = 0; i < dir->nbuckets; ++i)
+  {
+    steps = 0;
+    for(entry = dir->buckets[i]; entry != NULL; entry = entry->hash_next)
+    {
+      if(entry < first || entry >= last
+      || (entry->hash & (dir->nbuckets-1)) != i
+      || ++steps > dir->nchildren)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*! Load an image's tree from an index cache file
+ *
+ *  @param[in,out] image Mapped image
+ *  @param[in]     file  Index cache file name
+ *  @param[in]     path  Absolute path of the NDS file
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the index is missing, stale or invalid
+ */
+static int
+nitro_index_load(nitro_image_t *image,
+                 const char    *file,
+                 const char    *path)
+{
+  nitro_arena_t        *arena = &image->arena;
+  nitro_index_header_t *want, *hdr;
+  struct stat          st;
+  unsigned char        *data;
+  uintptr_t            base, entries_end, buckets, names, end, delta;
+  size_t               i;
+  int                  fd, ok;
+
+  want = (nitro_index_header_t*)malloc(sizeof(*want));
+  hdr  = (nitro_index_header_t*)malloc(sizeof(*hdr));
+  fd   = open(file, O_RDONLY);
+  if(want == NULL || hdr == NULL || fd < 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    free(want);
+    free(hdr);
+    return -1;
+  }
+
+  /* the key must match this NDS file exactly, and the layout must fit */
+  nitro_index_key(image, want, path);
+  ok = pread(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr)
+    && memcmp(hdr, want, offsetof(nitro_index_header_t, base)) == 0
+    && strcmp(hdr->path, want->path) == 0
+    && fstat(fd, &st) == 0
+    && hdr->arena_size <= (uint64_t)st.st_size
+    && hdr->data_offset <= (uint64_t)st.st_size - hdr->arena_size
+    && hdr->nentries != 0
+    && hdr->nentries <= hdr->buckets / sizeof(nitrofs_entry_t)
+    && hdr->buckets % sizeof(nitrofs_entry_t*) == 0
+    && hdr->nbuckets <= (hdr->names - hdr->buckets) / sizeof(nitrofs_entry_t*)
+    && hdr->buckets <= hdr->names
+    && hdr->names + hdr->names_len == hdr->arena_size;
+  free(want);
+  if(!ok)
+  {
+    close(fd);
+    free(hdr);
+    return -1;
+  }
+
+  /* map the image, preferably where it was when it was written */
+  data = mmap((void*)(uintptr_t)hdr->base, hdr->arena_size,
+              PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, hdr->data_offset);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    free(hdr);
+    return -1;
+  }
+
+  arena->base      = data;
+  arena->size      = hdr->arena_size;
+  arena->entries   = (nitrofs_entry_t*)data;
+  arena->buckets   = (nitrofs_entry_t**)(data + hdr->buckets);
+  arena->names     = (char*)data + hdr->names;
+  arena->nentries  = arena->max_entries = hdr->nentries;
+  arena->nbuckets  = arena->max_buckets = hdr->nbuckets;
+  arena->names_len = arena->max_names   = hdr->names_len;
+
+  /* check every pointer, relocating it if the image moved */
+  base        = hdr->base;
+  entries_end = base + hdr->nentries * sizeof(nitrofs_entry_t);
+  buckets     = base + hdr->buckets;
+  names       = base + hdr->names;
+  end         = base + hdr->arena_size;
+  delta       = (uintptr_t)data - base;
+  free(hdr);
+
+  for(i = 0; i < arena->nentries; ++i)
+  {
+    nitrofs_entry_t *entry = &arena->entries[i];
+
+    /* the image pointer is meaningless across processes, and so is
+     * the archive pointer, though archive entries stay marked by it; LZ77
+     * verdicts are reached again under this mount's options, and no file
+     * is open yet
+     */
+    entry->image  = image;
+    entry->rom    = NULL;
+    entry->lz     = NITRO_LZ_UNKNOWN;
+    entry->opens  = 0;
+    entry->pinned = NULL;
+
+    if(nitro_index_reloc(&entry->parent,    base,    entries_end, sizeof(nitrofs_entry_t),  delta) != 0
+    || nitro_index_reloc(&entry->next,      base,    entries_end, sizeof(nitrofs_entry_t),  delta) != 0
+    || nitro_index_reloc(&entry->children,  base,    entries_end, sizeof(nitrofs_entry_t),  delta) != 0
+    || nitro_index_reloc(&entry->hash_next, base,    entries_end, sizeof(nitrofs_entry_t),  delta) != 0
+    || nitro_index_reloc(&entry->buckets,   buckets, names,       sizeof(nitrofs_entry_t*), delta) != 0
+    || nitro_index_reloc(&entry->name,      names,   end,         1,                        delta) != 0
+    || entry->name == NULL
+    || (entry->type != NITRO_FILE_TYPE && entry->type != NITRO_DIR_TYPE)
+    || (entry->type == NITRO_DIR_TYPE && !entry->loaded))
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+
+    /* the name must be terminated inside name storage, and file data
+     * (archives included) must be inside the NDS file
+     */
+    if(entry->namelen >= (size_t)(arena->names + arena->names_len - entry->name)
+    || entry->name[entry->namelen] != 0
+    || ((entry->type == NITRO_FILE_TYPE || entry->archive != NULL)
+        && (uint64_t)entry->offset + entry->size > image->size))
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+
+    /* siblings must be contiguous, since readdir indexes them */
+    if((entry->next != NULL && entry->next != entry + 1)
+    || (entry->children == NULL
+        ? entry->nchildren != 0
+        : entry->nchildren > (size_t)(&arena->entries[arena->nentries] - entry->children)))
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+  }
+  for(i = 0; i < arena->nbuckets; ++i)
+  {
+    if(nitro_index_reloc(&arena->buckets[i], base, entries_end, sizeof(nitrofs_entry_t), delta) != 0)
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+  }
+
+  /* with every pointer in range, check that lookups stay in range too */
+  for(i = 0; i < arena->nentries; ++i)
+  {
+    if(arena->entries[i].type == NITRO_DIR_TYPE
+    && nitro_index_check_dir(arena, &arena->entries[i]) != 0)
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+  }
+
+  /* only a fully checked tree gets archives, which read their entries */
+  for(i = 0; i < arena->nentries; ++i)
+  {
+    nitrofs_entry_t *entry = &arena->entries[i];
+
+    if(entry->archive != NULL
+    && (entry->archive = nitro_new_archive(entry)) == NULL)
+    {
+      nitro_destroy_tree(image);
+      return -1;
+    }
+  }
+
+  image->root = &arena->entries[0];
+  return 0;
+}
+
+/*! Write an image's tree to an index cache file
+ *
+ *  The file is written under a temporary name and renamed into place, so
+ *  concurrent mounts never see a partial index.
+ *
+ *  @param[in] image Image whose tree to write
+ *  @param[in] file  Index cache file name
+ *  @param[in] path  Absolute path of the NDS file
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_index_save(nitro_image_t *image,
+                 const char    *file,
+                 const char    *path)
+{
+  nitro_arena_t        *arena = &image->arena;
+  nitro_index_header_t *hdr;
+  char                 *tmp;
+  long                 pagesize = sysconf(_SC_PAGESIZE);
+  int                  fd, rc = -1;
+
+  hdr = (nitro_index_header_t*)malloc(sizeof(*hdr));
+  tmp = (char*)malloc(strlen(file) + sizeof(".XXXXXX"));
+  if(hdr == NULL || tmp == NULL)
+  {
+    free(hdr);
+    free(tmp);
+    return -1;
+  }
+
+  /* describe the arena; the image is page-aligned so it can be mapped */
+  nitro_index_key(image, hdr, path);
+  hdr->base        = (uintptr_t)arena->base;
+  hdr->data_offset = (sizeof(*hdr) + pagesize-1) & ~(pagesize-1);
+  hdr->buckets     = (char*)arena->buckets - (char*)arena->base;
+  hdr->names       = arena->names - (char*)arena->base;
+  hdr->arena_size  = hdr->names + arena->names_len;
+  hdr->nentries    = arena->nentries;
+  hdr->nbuckets    = arena->nbuckets;
+  hdr->names_len   = arena->names_len;
+
+  sprintf(tmp, "%s.XXXXXX", file);
+  fd = mkstemp(tmp);
+  if(fd >= 0)
+  {
+    if(pwrite(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr)
+    && pwrite(fd, arena->base, hdr->arena_size, hdr->data_offset) == (ssize_t)hdr->arena_size
+    && fchmod(fd, 0644) == 0
+    && close(fd) == 0)
+      rc = rename(tmp, file);
+    else
+      close(fd);
+
+    if(rc != 0)
+      unlink(tmp);
+  }
+
+  free(hdr);
+  free(tmp);
+  return rc;
+}
+
+/*! Load the tree for a mapped NDS file
+ *
+ *  With a cache directory, the tree is loaded from its index cache file if
+ *  one is present and up to date; otherwise the whole tree is built and
+ *  the index is written for next time.
+ *
+ *  @param[in,out] image  Mapped image
+ *  @param[out]    cached Set to whether the index cache was used (may be NULL)
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_load_tree(nitro_image_t *image,
+                int           *cached)
+{
+  char *path, *file;
+  int  rc;
+
+  if(cached != NULL)
+    *cached = 0;
+  if(nitro_opts.cache_dir == NULL)
+    return nitro_build_tree(image, nitro_opts.lazy);
+
+  path = realpath(image->file, NULL);
+  file = path != NULL ? nitro_index_file(path) : NULL;
+  if(file == NULL)
+  {
+    free(path);
+    return nitro_build_tree(image, nitro_opts.lazy);
+  }
+
+  rc = nitro_index_load(image, file, path);
+  if(rc == 0)
+  {
+    if(cached != NULL)
+      *cached = 1;
+  }
+  else
+  {
+    /* an index needs the whole tree */
+    rc = nitro_build_tree(image, 0);
+
+    if(rc == 0 && nitro_index_save(image, file, path) != 0)
+      fprintf(stderr, "%s: failed to write index %s\n", image->file, file);
+  }
+
+  free(file);
+  free(path);
+  return rc;
+}
+
+/*! Map an NDS file and load its tree
+ *
+ *  @param[in,out] image  Image to load
+ *  @param[out]    cached Set to whether the index cache was used (may be NULL)
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_load_image(nitro_image_t *image,
+                 int           *cached)
+{
+  /* open and map the nds file */
+  if(nitro_map_rom(image) != 0)
+    return -1;
+
+  /* locate the FNT and FAT */
+  if(nitro_read_header(image) != 0)
+  {
+    fprintf(stderr, "%s: invalid NitroFS header\n", image->file);
+    nitro_unmap_rom(image);
+    return -1;
+  }
+  nitro_advise_tables(image);
+
+  /* build the nitro tree */
+  if(nitro_load_tree(image, cached) != 0)
+  {
+    fprintf(stderr, "%s: failed to parse NitroFS tables\n", image->file);
+    nitro_unmap_rom(image);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! Release an image's tree, mapping and cached derived data
+ *
+ *  Safe to call on an image which was never loaded.
+ *
+ *  @param[in,out] image Image to unload
+ */
+static void
+nitro_unload_image(nitro_image_t *image)
+{
+  /* the image's address may be reused; don't let its blocks be found */
+  nitro_cache_drop(image);
+
+  nitro_destroy_tree(image);
+  nitro_unmap_rom(image);
+}
+
+/*! Load a new image of an NDS file
+ *
+ *  @param[in] rom NDS file to load
+ *
+ *  @returns image, holding the NDS file's reference
+ *  @returns NULL for failure
+ */
+static nitro_image_t*
+nitro_new_image(nitro_rom_t *rom)
+{
+  nitro_image_t *image = (nitro_image_t*)malloc(sizeof(nitro_image_t));
+
+  if(image == NULL)
+    return NULL;
+
+  nitro_init_image(image, rom->file);
+  image->rom  = rom;
+  image->refs = 1;
+  if(nitro_load_image(image, NULL) != 0)
+  {
+    pthread_mutex_destroy(&image->lock);
+    free(image);
+    return NULL;
+  }
+
+  return image;
+}
+
+/*! Free an image
+ *
+ *  @param[in] image Image to free
+ */
+static void
+nitro_free_image(nitro_image_t *image)
+{
+  nitro_unload_image(image);
+  pthread_mutex_destroy(&image->lock);
+  free(image);
+}
+
+/*! Drop references to an image, freeing it when the last one goes
+ *
+ *  @param[in] image Image to release (may be NULL)
+ *  @param[in] count Number of references to drop
+ */
+static void
+nitro_image_put(nitro_image_t *image,
+                uint64_t      count)
+{
+  if(image != NULL && __atomic_sub_fetch(&image->refs, count, __ATOMIC_ACQ_REL) == 0)
+    nitro_free_image(image);
+}
+
+/*! Take references to the image an entry belongs to
+ *
+ *  The caller must already hold a reference, so the image can't go away.
+ *  Top-level entries are never freed and aren't counted, and entries in
+ *  an archive count against the archive's owner.
+ *
+ *  @param[in] entry Entry to reference
+ *  @param[in] count Number of references to take
+ */
+static void
+nitro_entry_get(nitrofs_entry_t *entry,
+                uint64_t        count)
+{
+  if(entry->image != &top_image)
+    __atomic_fetch_add(&entry->image->owner->refs, count, __ATOMIC_RELAXED);
+}
+
+/*! Drop references to the image an entry belongs to
+ *
+ *  @param[in] entry Entry to release
+ *  @param[in] count Number of references to drop
+ */
+static void
+nitro_entry_put(nitrofs_entry_t *entry,
+                uint64_t        count)
+{
+  if(entry->image != &top_image)
+    nitro_image_put(entry->image->owner, count);
+}
+
+/*! Load the current image of an NDS file if it isn't loaded yet
+ *
+ *  @param[in,out] rom NDS file to load
+ */
+static void
+nitro_load_rom(nitro_rom_t *rom)
+{
+  nitro_image_t *image;
+
+  pthread_mutex_lock(&rom->lock);
+  if(rom->image == NULL && !rom->broken)
+  {
+    /* don't keep retrying a bad NDS file on every access */
+    image = nitro_new_image(rom);
+    if(image == NULL)
+      rom->broken = 1;
+    else
+      __atomic_store_n(&rom->image, image, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&rom->lock);
+}
+
+/*! Take a reference to the current image of an NDS file
+ *
+ *  A reloader swaps the image and then waits for pins to drain, so an
+ *  image seen here always gets its reference before it can be freed.
+ *
+ *  @param[in] rom  NDS file
+ *  @param[in] load Whether to load the image if it isn't loaded yet
+ *
+ *  @returns image, which must be released with nitro_image_put
+ *  @returns NULL if the image is not (or could not be) loaded
+ */
+static nitro_image_t*
+nitro_rom_get(nitro_rom_t *rom,
+              int         load)
+{
+  nitro_image_t *image;
+
+  for(;;)
+  {
+    __atomic_fetch_add(&rom->pins, 1, __ATOMIC_SEQ_CST);
+    image = __atomic_load_n(&rom->image, __ATOMIC_SEQ_CST);
+    if(image != NULL)
+      __atomic_fetch_add(&image->refs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&rom->pins, 1, __ATOMIC_SEQ_CST);
+
+    if(image != NULL || !load)
+      return image;
+
+    /* load it and try once more */
+    nitro_load_rom(rom);
+    load = 0;
+  }
+}
+
+/*! Get the root of an archive's tree, building it on first use
+ *
+ *  The archive lives as long as the image holding it, which the caller
+ *  must hold a reference to.
+ *
+ *  @param[in] entry Archive directory
+ *
+ *  @returns root directory
+ *  @returns NULL if the archive's tables are corrupt
+ */
+static nitrofs_entry_t*
+nitro_archive_root(nitrofs_entry_t *entry)
+{
+  nitro_image_t   *archive = entry->archive;
+  nitrofs_entry_t *root;
+
+  /* fast path; already built */
+  root = __atomic_load_n(&archive->root, __ATOMIC_ACQUIRE);
+  if(root != NULL)
+    return root;
+
+  pthread_mutex_lock(&archive->lock);
+  if(archive->root == NULL && !archive->broken
+  && nitro_build_tree(archive, nitro_opts.lazy) != 0)
+    archive->broken = 1;
+  root = archive->root;
+  pthread_mutex_unlock(&archive->lock);
+
+  return root;
+}
+
+/*! Get the directory holding an entry's children
+ *
+ *  For a mount directory, this is the root of the current image of its
+ *  NDS file, which is loaded if needed. For an archive directory, it is
+ *  the root of the archive's tree.
+ *
+ *  @param[in]  entry Entry to resolve
+ *  @param[out] pin   Set to the image referenced for the caller, if any;
+ *                    release it with nitro_image_put once done
+ *
+ *  @returns directory
+ *  @returns NULL if the NDS file or archive could not be loaded
+ */
+static nitrofs_entry_t*
+nitro_resolve(nitrofs_entry_t *entry,
+              nitro_image_t   **pin)
+{
+  if(entry->archive != NULL)
+    return nitro_archive_root(entry);
+  if(entry->rom == NULL)
+    return entry;
+
+  *pin = nitro_rom_get(entry->rom, 1);
+  return *pin != NULL ? (*pin)->root : NULL;
+}
+
+/*! Get the directory a tree is browsed at
+ *
+ *  The root of an image's or archive's tree is its own parent, so this
+ *  maps it to the mount directory of its NDS file, or to its archive's
+ *  directory, as a path lookup would find it.
+ *
+ *  @param[in] entry Directory
+ *
+ *  @returns the directory as it is looked up
+ */
+static nitrofs_entry_t*
+nitro_mount_point(nitrofs_entry_t *entry)
+{
+  nitro_image_t *image = entry->image;
+
+  if(image == &top_image || entry != image->root)
+    return entry;
+  if(image->owner != image)
+    return image->mount;
+  return image->rom->mount;
+}
+
+/*! Set up an NDS file to serve
+ *
+ *  @param[out] rom  NDS file to set up
+ *  @param[in]  file NDS file name (ownership is taken)
+ */
+static void
+nitro_init_rom(nitro_rom_t *rom,
+               char        *file)
+{
+  const char *base = strrchr(file, '/');
+
+  memset(rom, 0, sizeof(*rom));
+  rom->file = file;
+  rom->base = base != NULL ? base + 1 : file;
+  pthread_mutex_init(&rom->lock, NULL);
+}
+
+/*! Release every NDS file and the top-level directories
+ *
+ *  Only called once nothing is being served, so current images are freed
+ *  whatever references remain.
+ */
+static void
+nitro_free_roms(void)
+{
+  size_t i;
+
+  for(i = 0; i < nroms; ++i)
+  {
+    if(roms[i].image != NULL)
+      nitro_free_image(roms[i].image);
+    pthread_mutex_destroy(&roms[i].lock);
+    free(roms[i].file);
+  }
+  free(roms);
+  roms  = NULL;
+  nroms = 0;
+
+  nitro_destroy_tree(&top_image);
+  root = NULL;
+}
+
+/*! Select NDS files when scanning a directory
+ *
+ *  @param[in] dent Directory entry
+ *
+ *  @returns whether the entry is named like an NDS file
+ */
+static int
+nitro_is_nds(const struct dirent *dent)
+{
+  size_t len = strlen(dent->d_name);
+
+  return len >= 4 && strcasecmp(dent->d_name + len - 4, ".nds") == 0;
+}
+
+/*! Join a directory and a file name
+ *
+ *  @param[in] dir  Directory
+ *  @param[in] name File name
+ *
+ *  @returns allocated path
+ *  @returns NULL for failure
+ */
+static char*
+nitro_join_path(const char *dir,
+                const char *name)
+{
+  char *path = (char*)malloc(strlen(dir) + 1 + strlen(name) + 1);
+
+  if(path != NULL)
+    sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/*! Set up the root as the mount directory of a single NDS file
+ *
+ *  The NDS file is loaded up front.
+ *
+ *  @param[in] file NDS file name
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_single_rom(const char *file)
+{
+  nitro_image_t *image;
+  char          *copy = strdup(file);
+
+  roms = (nitro_rom_t*)malloc(sizeof(nitro_rom_t));
+  if(copy == NULL || roms == NULL)
+  {
+    free(copy);
+    free(roms);
+    roms = NULL;
+    return -1;
+  }
+  nitro_init_rom(roms, copy);
+  nroms = 1;
+
+  /* the top level is just the root */
+  nitro_init_image(&top_image, NULL);
+  if(nitro_arena_init(&top_image.arena, 1, 1) != 0)
+  {
+    nitro_free_roms();
+    return -1;
+  }
+
+  root = nitro_alloc_entry(&top_image.arena);
+  root->image = &top_image;
+  nitro_init_dir(root, root, NITRO_ROOT);
+  root->rom     = roms;
+  root->name    = nitro_alloc_name(&top_image.arena, "", 0);
+  root->namelen = 0;
+  root->hash    = nitro_hash_name(root->name, 0);
+  roms->mount   = root;
+
+  image = nitro_rom_get(roms, 1);
+  if(image == NULL)
+  {
+    nitro_free_roms();
+    return -1;
+  }
+  nitro_image_put(image, 1);
+  return 0;
+}
+
+/*! Set up a top-level mount directory for every NDS file in a directory
+ *
+ *  Only the files are stat'd here; each one is mapped and parsed when its
+ *  directory is first used.
+ *
+ *  @param[in] dir Directory to scan
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+nitro_scan_roms(const char *dir)
+{
+  struct dirent   **names;
+  struct stat     st;
+  nitrofs_entry_t *top, *mount, **last;
+  size_t          names_len = 1;
+  int             i, n;
+
+  if(stat(dir, &st) != 0)
+  {
+    perror("stat");
+    return -1;
+  }
+
+  n = scandir(dir, &names, nitro_is_nds, alphasort);
+  if(n < 0)
+  {
+    perror("scandir");
+    return -1;
+  }
+
+  /* the top level directory takes its times from the directory */
+  nitro_init_image(&top_image, NULL);
+  top_image.atime = st.st_atime;
+  top_image.mtime = st.st_mtime;
+  top_image.ctime = st.st_ctime;
+
+  /* set up each regular file; it's loaded on first use */
+  roms = (nitro_rom_t*)calloc(n > 0 ? n : 1, sizeof(nitro_rom_t));
+  for(i = 0; roms != NULL && i < n; ++i)
+  {
+    char *file = nitro_join_path(dir, names[i]->d_name);
+
+    if(file == NULL || stat(file, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      free(file);
+      free(names[i]);
+      names[i] = NULL;
+      continue;
+    }
+
+    nitro_init_rom(&roms[nroms], file);
+    roms[nroms].atime = st.st_atime;
+    roms[nroms].mtime = st.st_mtime;
+    roms[nroms].ctime = st.st_ctime;
+    names_len += strlen(names[i]->d_name) + 1;
+    ++nroms;
+  }
+
+  /* the top level is one directory of mount directories */
+  if(roms == NULL
+  || nitro_arena_init(&top_image.arena, nroms + 1, names_len) != 0)
+    top = NULL;
+  else
+    top = nitro_alloc_entry(&top_image.arena);
+
+  if(top != NULL)
+  {
+    top->image = &top_image;
+    nitro_init_dir(top, top, NITRO_ROOT);
+    top->name    = nitro_alloc_name(&top_image.arena, "", 0);
+    top->namelen = 0;
+    top->hash    = nitro_hash_name(top->name, 0);
+
+    last = &top->children;
+    nroms = 0;
+    for(i = 0; i < n; ++i)
+    {
+      size_t len;
+
+      if(names[i] == NULL)
+        continue;
+
+      len = strlen(names[i]->d_name);
+      mount = nitro_alloc_entry(&top_image.arena);
+      nitro_init_dir(mount, top, NITRO_ROOT);
+      mount->rom     = &roms[nroms];
+      mount->name    = nitro_alloc_name(&top_image.arena, names[i]->d_name, len);
+      mount->namelen = len;
+      mount->hash    = nitro_hash_name(mount->name, len);
+      roms[nroms++].mount = mount;
+
+      /* update the parent */
+      *last = mount;
+      last  = &mount->next;
+      ++top->nchildren;
+      top->links += 1;
+      top->size  += len + 3;
+    }
+
+    if(nitro_index_dir(top) == 0)
+    {
+      top->loaded    = 1;
+      top_image.root = top;
+      root           = top;
+    }
+  }
+
+  for(i = 0; i < n; ++i)
+    free(names[i]);
+  free(names);
+
+  if(root == NULL)
+  {
+    nitro_free_roms();
+    return -1;
+  }
+  return 0;
+}
+
+/*! Build index cache files for every NDS file in a directory
+ *
+ *  @param[in] dir Directory to scan
+ *
+ *  @returns 0 for success
+ *  @returns -1 if any NDS file could not be indexed
+ */
+static int
+nitro_prebuild(const char *dir)
+{
+  nitro_image_t image;
+  struct dirent **names;
+  int           i, n, cached, rc = 0;
+
+  n = scandir(dir, &names, nitro_is_nds, alphasort);
+  if(n < 0)
+  {
+    perror("scandir");
+    return -1;
+  }
+
+  for(i = 0; i < n; ++i)
+  {
+    char *file = nitro_join_path(dir, names[i]->d_name);
+
+    free(names[i]);
+    if(file == NULL)
+    {
+      rc = -1;
+      continue;
+    }
+
+    nitro_init_image(&image, file);
+    if(nitro_load_image(&image, &cached) != 0)
+      rc = -1;
+    else
+    {
+      printf("%s: %s\n", file, cached ? "up to date" : "indexed");
+      nitro_unload_image(&image);
+    }
+    pthread_mutex_destroy(&image.lock);
+    free(file);
+  }
+
+  free(names);
+  return rc;
+}
+
+/*! Count an upcall
+ *
+ *  @param[in,out] counter Counter to increment
+ */
+static void
+nitro_count(uint64_t *counter)
+{
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*! Count a file read
+ *
+ *  @param[in] size Size requested
+ */
+static void
+nitro_count_read(size_t size)
+{
+  uint64_t largest = __atomic_load_n(&nitro_stats.largest, __ATOMIC_RELAXED);
+
+  nitro_count(&nitro_stats.read);
+  __atomic_fetch_add(&nitro_stats.bytes, size, __ATOMIC_RELAXED);
+  while(size > largest
+  && !__atomic_compare_exchange_n(&nitro_stats.largest, &largest, size, 1,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*! Print the upcall and cache counters
+ *
+ *  @param[in] fp Stream to print to
+ */
+static void
+nitro_print_stats(FILE *fp)
+{
+  fprintf(fp, "lookup:  %" PRIu64 "\n", __atomic_load_n(&nitro_stats.lookup,  __ATOMIC_RELAXED));
+  fprintf(fp, "getattr: %" PRIu64 "\n", __atomic_load_n(&nitro_stats.getattr, __ATOMIC_RELAXED));
+  fprintf(fp, "opendir: %" PRIu64 "\n", __atomic_load_n(&nitro_stats.opendir, __ATOMIC_RELAXED));
+  fprintf(fp, "readdir: %" PRIu64 "\n", __atomic_load_n(&nitro_stats.readdir, __ATOMIC_RELAXED));
+  fprintf(fp, "open:    %" PRIu64 "\n", __atomic_load_n(&nitro_stats.open,    __ATOMIC_RELAXED));
+  fprintf(fp, "read:    %" PRIu64 "\n", __atomic_load_n(&nitro_stats.read,    __ATOMIC_RELAXED));
+
+  fprintf(fp, "read bytes:      %" PRIu64 "\n", __atomic_load_n(&nitro_stats.bytes,   __ATOMIC_RELAXED));
+  fprintf(fp, "largest read:    %" PRIu64 "\n", __atomic_load_n(&nitro_stats.largest, __ATOMIC_RELAXED));
+  fprintf(fp, "max_readahead:   %" PRIu64 "\n", nitro_stats.ra);
+  fprintf(fp, "max_write:       %" PRIu64 "\n", nitro_stats.write);
+  fprintf(fp, "lz decompressed: %" PRIu64 "\n", __atomic_load_n(&nitro_stats.lz, __ATOMIC_RELAXED));
+
+  pthread_mutex_lock(&nitro_cache.lock);
+  fprintf(fp, "cache hits:      %" PRIu64 "\n", nitro_cache.hits);
+  fprintf(fp, "cache misses:    %" PRIu64 "\n", nitro_cache.misses);
+  fprintf(fp, "cache evictions: %" PRIu64 "\n", nitro_cache.evictions);
+  fprintf(fp, "cache size:      %zu\n", nitro_cache.size);
+  pthread_mutex_unlock(&nitro_cache.lock);
+}
+
+/*! Parse the LZ77 header of a file
+ *
+ *  The header is the compression type followed by the 24-bit decompressed
+ *  size; LZ11 data too large for that stores zero there and the size in
+ *  the next word. There is no magic number, so this only checks that the
+ *  sizes are plausible: literals cost an extra flag bit each, an LZ10
+ *  match of at most 18 bytes takes 2 bytes plus a flag bit, and an LZ11
+ *  match of at most 0x10110 bytes takes 4 bytes plus a flag bit.
+ *  nitro_lz_size decides whether the file really is compressed.
+ *
+ *  @param[in]  entry File to check
+ *  @param[out] hdr   Set to the header length (may be NULL)
+ *
+ *  @returns decompressed size
+ *  @returns 0 if the file is not presented decompressed
+ */
+static uint32_t
+nitro_lz_header(nitrofs_entry_t *entry,
+                uint32_t        *hdr)
+{
+  const unsigned char *p;
+  uint32_t            len = 4, size;
+
+  /* system files are always presented as stored */
+  if(!nitro_opts.lz || entry->type != NITRO_FILE_TYPE || entry->sys || entry->size < 4)
+    return 0;
+
+  p = entry->image->mapping + entry->offset;
+  if(p[0] != NITRO_LZ10 && p[0] != NITRO_LZ11)
+    return 0;
+
+  size = p[1] | (p[2] << 8) | (p[3] << 16);
+  if(size == 0 && p[0] == NITRO_LZ11 && entry->size >= 8)
+  {
+    size = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+    len  = 8;
+  }
+
+  /* allow for padding to a word boundary */
+  if(size == 0 || entry->size - len > size + size/8 + 4)
+    return 0;
+  if(p[0] == NITRO_LZ10 && size > (uint64_t)(entry->size - len) * 9)
+    return 0;
+  if(p[0] == NITRO_LZ11 && size > (uint64_t)(entry->size - len) * 8 * 0x10110 / 33)
+    return 0;
+
+  if(hdr != NULL)
+    *hdr = len;
+  return size;
+}
+
+/*! Decompress LZ77 data
+ *
+ *  @param[out] dst  Buffer to fill (NULL to only check the data)
+ *  @param[in]  size Decompressed size
+ *  @param[in]  src  Compressed data (following the header)
+ *  @param[in]  len  Length of compressed data
+ *  @param[in]  type NITRO_LZ10 or NITRO_LZ11
+ *  @param[out] used Set to the length of compressed data consumed (may be NULL)
+ *
+ *  @returns 0 for success
+ *  @returns -1 for corrupt data
+ */
+static int
+nitro_lz_decompress(unsigned char       *dst,
+                    uint32_t            size,
+                    const unsigned char *src,
+                    uint32_t            len,
+                    int                 type,
+                    uint32_t            *used)
+{
+  const unsigned char *start = src, *end = src + len;
+  uint32_t            pos = 0, count, disp;
+  unsigned int        flags = 0, bit = 0;
+
+  while(pos < size)
+  {
+    /* each flag byte describes the next eight tokens, MSB first */
+    if(bit == 0)
+    {
+      if(src >= end)
+        return -1;
+      flags = *src++;
+      bit   = 0x80;
+    }
+
+    if(!(flags & bit))
+    {
+      /* literal byte */
+      if(src >= end)
+        return -1;
+      if(dst != NULL)
+        dst[pos] = *src;
+      ++pos;
+      ++src;
+    }
+    else
+    {
+      /* match; LZ11 encodes longer matches in 3 or 4 bytes */
+      if(end - src < 2)
+        return -1;
+      if(type == NITRO_LZ10)
+      {
+        count = (src[0] >> 4) + 3;
+        disp  = ((src[0] & 0x0F) << 8) | src[1];
+        src  += 2;
+      }
+      else if((src[0] >> 4) > 1)
+      {
+        count = (src[0] >> 4) + 1;
+        disp  = ((src[0] & 0x0F) << 8) | src[1];
+        src  += 2;
+      }
+      else if((src[0] >> 4) == 0)
+      {
+        if(end - src < 3)
+          return -1;
+        count = (((src[0] & 0x0F) << 4) | (src[1] >> 4)) + 0x11;
+        disp  = ((src[1] & 0x0F) << 8) | src[2];
+        src  += 3;
+      }
+      else
+      {
+        if(end - src < 4)
+          return -1;
+        count = (((src[0] & 0x0F) << 12) | (src[1] << 4) | (src[2] >> 4)) + 0x111;
+        disp  = ((src[2] & 0x0F) << 8) | src[3];
+        src  += 4;
+      }
+
+      /* the match may not reach before the start of the output */
+      if(disp >= pos)
+        return -1;
+      if(count > size - pos)
+        count = size - pos;
+
+      /* copy bytewise; a match may overlap its own output */
+      if(dst == NULL)
+        pos += count;
+      while(dst != NULL && count-- > 0)
+      {
+        dst[pos] = dst[pos - disp - 1];
+        ++pos;
+      }
+    }
+
+    bit >>= 1;
+  }
+
+  if(used != NULL)
+    *used = src - start;
+  return 0;
+}
+
+/*! Decide whether a file is presented decompressed
+ *
+ *  A file is only taken to be compressed if its data decompresses to
+ *  exactly the size in its header and ends there, give or take padding to
+ *  a word boundary; anything else is presented as stored. Checking means
+ *  scanning the whole file, so the verdict is kept in the entry.
+ *
+ *  @param[in]  entry File to check
+ *  @param[out] hdr   Set to the header length (may be NULL)
+ *
+ *  @returns decompressed size
+ *  @returns 0 if the file is not presented decompressed
+ */
+static uint32_t
+nitro_lz_size(nitrofs_entry_t *entry,
+              uint32_t        *hdr)
+{
+  const unsigned char *p;
+  uint32_t            size, len, used;
+  uint8_t             lz = __atomic_load_n(&entry->lz, __ATOMIC_ACQUIRE);
+
+  if(lz == NITRO_LZ_UNKNOWN)
+  {
+    /* racing checkers reach the same verdict */
+    lz   = NITRO_LZ_RAW;
+    size = nitro_lz_header(entry, &len);
+    p    = entry->image->mapping + entry->offset;
+    if(size != 0
+    && nitro_lz_decompress(NULL, size, p + len, entry->size - len, p[0], &used) == 0
+    && entry->size - len - used < 4)
+    {
+      entry->lz_size = size;
+      entry->lz_hdr  = len;
+      lz = NITRO_LZ_PACKED;
+    }
+    __atomic_store_n(&entry->lz, lz, __ATOMIC_RELEASE);
+  }
+
+  if(lz != NITRO_LZ_PACKED)
+    return 0;
+
+  if(hdr != NULL)
+    *hdr = entry->lz_hdr;
+  return entry->lz_size;
+}
+
+/*! Get the size of a file as presented
+ *
+ *  @param[in] entry File to check
+ *
+ *  @returns file size
+ */
+static uint32_t
+nitro_file_size(nitrofs_entry_t *entry)
+{
+  uint32_t size = nitro_lz_size(entry, NULL);
+
+  return size != 0 ? size : entry->size;
+}
+
+/*! Clamp a read request to the extent of a file
+ *
+ *  @param[in] entry  File to read
+ *  @param[in] size   Requested size
+ *  @param[in] offset Offset to start at
+ *
+ *  @returns number of bytes that can be read
+ */
+static size_t
+nitro_read_size(nitrofs_entry_t *entry,
+                size_t          size,
+                off_t           offset)
+{
+  uint32_t file_size = nitro_file_size(entry);
+
+  /* past end-of-file (or before the start); nothing to read */
+  if(offset < 0 || (uint64_t)offset >= file_size)
+    return 0;
+
+  /* if they want to read past end-of-file, truncate the amount to read */
+  if(size > file_size - (uint64_t)offset)
+    size = file_size - (uint64_t)offset;
+
+  return size;
+}
+
+/*! Note that a file has been opened
+ *
+ *  @param[in] entry Entry opened
+ */
+static void
+nitro_file_opened(nitrofs_entry_t *entry)
+{
+  if(entry->type != NITRO_FILE_TYPE)
+    return;
+
+  pthread_mutex_lock(&nitro_cache.lock);
+  ++entry->opens;
+  pthread_mutex_unlock(&nitro_cache.lock);
+}
+
+/*! Note that a file has been closed
+ *
+ *  Once its last handle is closed, a file's contents kept by
+ *  nitro_file_data are dropped.
+ *
+ *  @param[in] entry Entry closed
+ */
+static void
+nitro_file_closed(nitrofs_entry_t *entry)
+{
+  nitro_block_t *blk = NULL;
+
+  if(entry->type != NITRO_FILE_TYPE)
+    return;
+
+  pthread_mutex_lock(&nitro_cache.lock);
+  if(--entry->opens == 0)
+  {
+    blk = entry->pinned;
+    entry->pinned = NULL;
+  }
+  pthread_mutex_unlock(&nitro_cache.lock);
+
+  nitro_cache_release(blk);
+}
+
+/*! Get the contents of a file as presented
+ *
+ *  Compressed files are decompressed into the derived data cache as a
+ *  single block (LZ77 can't be decompressed from the middle), so later
+ *  reads at any offset are served from memory until the block is evicted.
+ *  Concurrent first reads may each decompress; one copy wins. Should
+ *  decompression fail after all, the file is presented as stored from
+ *  then on.
+ *
+ *  Contents larger than the whole cache can't be cached; they are kept
+ *  with the file instead until its last handle is closed, so streaming
+ *  such a file doesn't decompress it again for every read.
+ *
+ *  @param[in]  entry File to read
+ *  @param[out] blk   Set to the cache block holding the contents, if any;
+ *                    release it with nitro_cache_release once done
+ *
+ *  @returns file contents
+ *  @returns NULL for corrupt data or memory exhaustion
+ */
+static const unsigned char*
+nitro_file_data(nitrofs_entry_t *entry,
+                nitro_block_t   **blk)
+{
+  nitro_image_t *image = entry->image;
+  uint32_t      size, hdr;
+
+  *blk = NULL;
+
+  size = nitro_lz_size(entry, &hdr);
+  if(size == 0)
+    return image->mapping + entry->offset;
+
+  if(size > nitro_cache.limit)
+  {
+    pthread_mutex_lock(&nitro_cache.lock);
+    *blk = entry->pinned;
+    if(*blk != NULL)
+      __atomic_fetch_add(&(*blk)->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&nitro_cache.lock);
+  }
+  else
+    *blk = nitro_cache_get(image, NITRO_VIEW_LZ, entry->id, 0);
+  if(*blk != NULL)
+    return (*blk)->data;
+
+  *blk = nitro_cache_alloc(image, NITRO_VIEW_LZ, entry->id, 0, size);
+  if(*blk == NULL)
+    return NULL;
+
+  if(nitro_lz_decompress((*blk)->data, size, image->mapping + entry->offset + hdr,
+                         entry->size - hdr, image->mapping[entry->offset], NULL) != 0)
+  {
+    nitro_cache_release(*blk);
+    *blk = NULL;
+    __atomic_store_n(&entry->lz, NITRO_LZ_RAW, __ATOMIC_RELEASE);
+    return image->mapping + entry->offset;
+  }
+  nitro_count(&nitro_stats.lz);
+
+  *blk = nitro_cache_insert(*blk);
+
+  /* too large for the cache; keep it while the file is open */
+  if(size > nitro_cache.limit)
+  {
+    pthread_mutex_lock(&nitro_cache.lock);
+    if(entry->opens != 0 && entry->pinned == NULL)
+    {
+      __atomic_fetch_add(&(*blk)->refs, 1, __ATOMIC_RELAXED);
+      entry->pinned = *blk;
+    }
+    pthread_mutex_unlock(&nitro_cache.lock);
+  }
+
+  return (*blk)->data;
+}
+
+/*! Copy part of a file as presented
+ *
+ *  @param[in]  entry  File to read
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Size to fill
+ *  @param[in]  offset Offset to start at
+ *
+ *  @returns number of bytes copied
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_copy_data(nitrofs_entry_t *entry,
+                char            *buffer,
+                size_t          size,
+                off_t           offset)
+{
+  const unsigned char *data;
+  nitro_block_t       *blk;
+
+  data = nitro_file_data(entry, &blk);
+  if(data == NULL)
+    return -EIO;
+
+  size = nitro_read_size(entry, size, offset);
+  memcpy(buffer, data + offset, size);
+  nitro_cache_release(blk);
+
+  return size;
+}
+
+/*! Get the inode number to report for an entry
+ *
+ *  The image's serial number makes inode numbers unique across images,
+ *  archives and reloads. A file from the FAT is numbered by its file ID,
+ *  so a file listed both by name and in /.by-id is one inode with two
+ *  links; any other entry is numbered by its place in the arena, above
+ *  every file ID.
+ *
+ *  @param[in] entry Entry to number
+ *
+ *  @returns inode number
+ */
+static uint64_t
+nitro_st_ino(nitrofs_entry_t *entry)
+{
+  uint64_t ino;
+
+  if(entry->type == NITRO_FILE_TYPE && !entry->sys)
+    ino = entry->id;
+  else
+    ino = (uint64_t)UINT16_MAX + 1 + (entry - entry->image->arena.entries);
+
+  return ((uint64_t)entry->image->serial << 32) | ino;
+}
+
+/*! Fill a stat struct from an entry
+ *
+ *  A mount directory whose NDS file isn't loaded gets placeholder
+ *  attributes (its own link count and size rather than those of the root
+ *  of the NDS file), which change once the file is loaded; the kernel
+ *  must not cache them for long.
+ *
+ *  @param[in]  entry Entry to use
+ *  @param[out] st    Buffer to fill
+ *  @param[in]  load  Whether to load a mount directory's NDS file
+ *
+ *  @returns whether the attributes are final (not placeholders)
+ */
+static int
+nitro_fill_stat(nitrofs_entry_t *entry,
+                struct stat     *st,
+                int             load)
+{
+  nitrofs_entry_t *source = entry, *tree;
+  nitro_image_t   *pin = NULL;
+  int             final = 1;
+
+  /* a mount directory looks like the root of its NDS file; unless asked
+   * to, don't load the NDS file just to stat it though
+   */
+  if(entry->rom != NULL && (pin = nitro_rom_get(entry->rom, load)) != NULL)
+    source = pin->root;
+  else if(entry->rom != NULL)
+    final = 0;
+  /* likewise an archive directory looks like the root of its tree */
+  else if(entry->archive != NULL && (tree = nitro_archive_root(entry)) != NULL)
+    source = tree;
+
+  /* directory size and link count depend on its children */
+  if(source->type == NITRO_DIR_TYPE && source->rom == NULL)
+    nitro_load_dir(source);
+
+  st->st_dev     = 0;
+  st->st_ino     = nitro_st_ino(entry);
+  st->st_nlink   = source->links;
+  st->st_uid     = getuid();
+  st->st_gid     = getgid();
+  st->st_rdev    = 0;
+  st->st_size    = nitro_file_size(source);
+  st->st_blksize = 4096;
+  st->st_blocks  = (st->st_size + st->st_blksize-1) / st->st_blksize;
+  if(source->rom != NULL)
+  {
+    st->st_atime = source->rom->atime;
+    st->st_mtime = source->rom->mtime;
+    st->st_ctime = source->rom->ctime;
+  }
+  else
+  {
+    st->st_atime = source->image->atime;
+    st->st_mtime = source->image->mtime;
+    st->st_ctime = source->image->ctime;
+  }
+  if(entry->type == NITRO_DIR_TYPE)
+    st->st_mode = NITRO_DIR_MODE;
+  else
+    st->st_mode = NITRO_FILE_MODE;
+
+  nitro_image_put(pin, 1);
+  return final;
+}
+
+/*! Look up a child of a directory named by ID
+ *
+ *  The name is parsed as an ID and looked up in the directory's ID index,
+ *  with no hashing or chain to walk.
+ *
+ *  @param[in] dir  Directory to search (already loaded)
+ *  @param[in] name Name to look up (need not be NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static nitrofs_entry_t*
+nitro_lookup_id(nitrofs_entry_t *dir,
+                const char      *name,
+                size_t          len)
+{
+  nitrofs_entry_t *entry;
+  uint32_t        id = 0;
+  size_t          i;
+
+  /* IDs have at most five digits */
+  if(len > 5)
+    return NULL;
+  for(i = 0; i < len; ++i)
+  {
+    if(name[i] < '0' || name[i] > '9')
+      return NULL;
+    id = id*10 + (name[i] - '0');
+  }
+  if(id >= dir->nbuckets)
+    return NULL;
+
+  /* the name must be spelled the way the entry is */
+  entry = dir->buckets[id];
+  if(entry == NULL || entry->namelen != len || memcmp(name, entry->name, len) != 0)
+    return NULL;
+  return entry;
+}
+
+/*! Look up a child of a directory by name
+ *
+ *  Mount and archive directories must be resolved with nitro_resolve
+ *  first.
+ *
+ *  @param[in] dir  Directory to search
+ *  @param[in] name Name to look up (need not be NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static nitrofs_entry_t*
+nitro_lookup(nitrofs_entry_t *dir,
+             const char      *name,
+             size_t          len)
+{
+  nitrofs_entry_t *entry;
+  uint32_t        hash;
+
+  /* only directories have children */
+  if(dir->type != NITRO_DIR_TYPE || nitro_load_dir(dir) != 0 || dir->nbuckets == 0)
+    return NULL;
+
+  /* directories named by ID are indexed by ID */
+  if(dir->by_id)
+    return nitro_lookup_id(dir, name, len);
+
+  /* walk the bucket for this name */
+  hash = nitro_hash_name(name, len);
+  for(entry = dir->buckets[hash & (dir->nbuckets-1)];
+      entry != NULL;
+      entry = entry->hash_next)
+  {
+    /* check if the name matches */
+    if(entry->hash == hash && entry->namelen == len
+    && memcmp(name, entry->name, len) == 0)
+      return entry;
+  }
+
+  /* didn't find this entry */
+  return NULL;
+}
+
+/*! Traverse path to get entry
+ *
+ *  @param[in]  path Path to traverse
+ *  @param[out] pin  Set to the image referenced for the caller, if any;
+ *                   release it with nitro_image_put once done
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static nitrofs_entry_t*
+nitro_traverse_path(const char    *path,
+                    nitro_image_t **pin)
+{
+  const char      *p;
+  nitrofs_entry_t *entry = root;
+
+  *pin = NULL;
+
+  /* look up each path component in turn */
+  while(entry != NULL && *path != 0)
+  {
+    /* skip separators */
+    while(*path == '/')
+      ++path;
+    if(*path == 0)
+      break;
+
+    /* find the end of this component */
+    for(p = path; *p != 0 && *p != '/'; ++p)
+      ;
+
+    /* step into an NDS file's tree at its mount directory */
+    entry = nitro_resolve(entry, pin);
+    if(entry != NULL)
+      entry = nitro_lookup(entry, path, p-path);
+    path = p;
+  }
+
+  return entry;
+}
+
+/*! Get attributes
+ *
+ *  @param[in]  path Path to lookup
+ *  @param[out] st   Buffer to fill
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_getattr(const char  *path,
+              struct stat *st)
+{
+  nitrofs_entry_t *entry;
+  nitro_image_t   *pin;
+
+  nitro_count(&nitro_stats.getattr);
+
+  /* the library caches the attributes for attr_timeout whatever they are,
+   * so it gets final ones
+   */
+  entry = nitro_traverse_path(path, &pin);
+  if(entry != NULL)
+    nitro_fill_stat(entry, st, 1);
+  nitro_image_put(pin, 1);
+
+  return entry != NULL ? 0 : -ENOENT;
+}
+
+#if FUSE_USE_VERSION >= 30
+/*! Get attributes, of an open file if fi is set
+ *
+ *  @param[in]  path Path to lookup (NULL if fi is set)
+ *  @param[out] st   Buffer to fill
+ *  @param[in]  fi   Open file information (may be NULL)
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_getattr3(const char            *path,
+               struct stat           *st,
+               struct fuse_file_info *fi)
+{
+  if(fi == NULL)
+    return nitro_getattr(path, st);
+
+  /* an open file or directory already knows its entry */
+  nitro_count(&nitro_stats.getattr);
+  nitro_fill_stat((nitrofs_entry_t*)fi->fh, st, 1);
+  return 0;
+}
+#endif
+
+/*! Add an entry to a high-level directory listing
+ *
+ *  @param[in]  filler Callback which fills buffer
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  name   Entry name
+ *  @param[in]  st     Entry attributes
+ *  @param[in]  final  Whether the attributes are final
+ *  @param[in]  offset Offset of the next entry
+ *
+ *  @returns 0 for success
+ *  @returns 1 if the buffer is full
+ */
+static int
+nitro_fill(fuse_fill_dir_t   filler,
+           void              *buffer,
+           const char        *name,
+           const struct stat *st,
+           int               final,
+           off_t             offset)
+{
+#if FUSE_USE_VERSION >= 30
+  /* complete attributes can be handed out by readdirplus; placeholders
+   * would be cached for attr_timeout, so leave those to getattr
+   */
+  return filler(buffer, name, st, offset, final ? FUSE_FILL_DIR_PLUS : 0);
+#else
+  (void)final;
+  return filler(buffer, name, st, offset);
+#endif
+}
+
+/*! Open directory
+ *
+ *  A mount directory's children are those of its NDS file's root, and an
+ *  archive's are those of the archive's root, but . and .. are the
+ *  directory and its parent as they were looked up.
+ */
+typedef struct
+{
+  nitrofs_entry_t *entry; /*!< Directory which was opened (. and ..) */
+  nitrofs_entry_t *dir;   /*!< Directory holding its children */
+} nitro_dir_t;
+
+/*! Open a directory's children
+ *
+ *  @param[in]  entry Directory to open
+ *  @param[out] fi    Open directory information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_open_dir(nitrofs_entry_t       *entry,
+               struct fuse_file_info *fi)
+{
+  nitro_dir_t   *handle;
+  nitro_image_t *pin = NULL;
+  int           rc = 0;
+
+  /* make sure its children are available to readdir */
+  handle = (nitro_dir_t*)malloc(sizeof(*handle));
+  if(handle == NULL)
+    rc = -ENOMEM;
+  else if((handle->dir = nitro_resolve(entry, &pin)) == NULL
+       || nitro_load_dir(handle->dir) != 0)
+    rc = -EIO;
+  else
+  {
+    /* the children keep their image alive, and the entry's image with
+     * them: an archive is owned by the image holding its file, and mount
+     * directories are never freed
+     */
+    handle->entry = nitro_mount_point(entry);
+    nitro_entry_get(handle->dir, 1);
+    fi->fh = (unsigned long)handle;
+  }
+
+  if(rc != 0)
+    free(handle);
+  nitro_image_put(pin, 1);
+  return rc;
+}
+
+/*! Close a directory opened with nitro_open_dir
+ *
+ *  @param[in] fi Open directory information
+ */
+static void
+nitro_close_dir(struct fuse_file_info *fi)
+{
+  nitro_dir_t *handle = (nitro_dir_t*)fi->fh;
+
+  nitro_entry_put(handle->dir, 1);
+  free(handle);
+}
+
+/*! Read a directory
+ *
+ *  @param[in]  path   Directory to read
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  filler Callback which fills buffer
+ *  @param[in]  offset Directory offset
+ *  @param[in]  fi     Open directory information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_readdir(const char            *path,
+              void                  *buffer,
+              fuse_fill_dir_t       filler,
+              off_t                 offset,
+              struct fuse_file_info *fi)
+{
+  struct stat     st;
+  int             final;
+
+  /* we set up this handle in nitro_opendir */
+  nitro_dir_t     *handle = (nitro_dir_t*)fi->fh;
+  nitrofs_entry_t *entry = handle->dir;
+  nitrofs_entry_t *child;
+
+  nitro_count(&nitro_stats.readdir);
+
+  /* offset 0 means '.' */
+  if(offset == 0)
+  {
+    final = nitro_fill_stat(handle->entry, &st, 0);
+    if(nitro_fill(filler, buffer, ".", &st, final, ++offset))
+      return 0;
+  }
+
+  /* offset 1 means '..' */
+  if(offset == 1)
+  {
+    final = nitro_fill_stat(nitro_mount_point(handle->entry->parent), &st, 0);
+    if(nitro_fill(filler, buffer, "..", &st, final, ++offset))
+      return 0;
+  }
+
+  /* children are contiguous, so resume straight at the desired offset */
+  while(offset >= 2 && offset - 2 < entry->nchildren)
+  {
+    child = &entry->children[offset - 2];
+    final = nitro_fill_stat(child, &st, 0);
+    if(nitro_fill(filler, buffer, child->name, &st, final, ++offset))
+      return 0;
+  }
+
+  return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+/*! Read a directory
+ *
+ *  @param[in]  path   Directory to read
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  filler Callback which fills buffer
+ *  @param[in]  offset Directory offset
+ *  @param[in]  fi     Open directory information
+ *  @param[in]  flags  Unused; attributes are always complete
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_readdir3(const char              *path,
+               void                    *buffer,
+               fuse_fill_dir_t         filler,
+               off_t                   offset,
+               struct fuse_file_info   *fi,
+               enum fuse_readdir_flags flags)
+{
+  return nitro_readdir(path, buffer, filler, offset, fi);
+}
+#endif
+
+/*! Start reading a file which has just been opened
+ *
+ *  Its extent of the NDS file is fetched in the background, so the first
+ *  reads don't each wait on a fault. This doesn't change the mapping's
+ *  flags, which would split it in two around every open file.
+ *
+ *  @param[in] entry File being opened
+ */
+static void
+nitro_prefetch(nitrofs_entry_t *entry)
+{
+  nitro_image_t *image = entry->image;
+  size_t        length = entry->size < NITRO_PREFETCH ? entry->size : NITRO_PREFETCH;
+
+  if(entry->type != NITRO_FILE_TYPE)
+    return;
+
+  /* splice reads come from the page cache rather than the mapping */
+  if(nitro_opts.splice && nitro_lz_size(entry, NULL) == 0)
+    posix_fadvise(image->fd, entry->offset, length, POSIX_FADV_WILLNEED);
+  else if(!image->owner->populated)
+    nitro_advise(image, entry->offset, length, MADV_WILLNEED);
+}
+
+/*! Open a file
+ *
+ *  @param[in]  path File to open
+ *  @param[out] fi   Open file information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_open(const char            *path,
+           struct fuse_file_info *fi)
+{
+  nitrofs_entry_t *entry;
+  nitro_image_t   *pin;
+  int             rc = 0;
+
+  nitro_count(&nitro_stats.open);
+
+  /* lookup the path */
+  entry = nitro_traverse_path(path, &pin);
+  if(entry == NULL)
+  {
+    /* we didn't find it. if O_CREAT was specified, return EROFS;
+     * otherwise, return ENOENT
+     */
+    rc = (fi->flags & O_CREAT) ? -EROFS : -ENOENT;
+  }
+  /* don't allow write mode */
+  else if((fi->flags & O_ACCMODE) == O_RDWR
+       || (fi->flags & O_ACCMODE) == O_WRONLY)
+    rc = -EACCES;
+  else
+  {
+    /* the open file keeps its image alive, and the image never changes,
+     * so keep whatever the kernel has cached
+     */
+    nitro_entry_get(entry, 1);
+    nitro_file_opened(entry);
+    fi->fh         = (unsigned long)entry;
+    fi->keep_cache = 1;
+    nitro_prefetch(entry);
+  }
+
+  nitro_image_put(pin, 1);
+  return rc;
+}
+
+/*! Read a file
+ *
+ *  @param[in]  path   Path of open file
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Size to fill
+ *  @param[in]  offset Offset to start at
+ *  @param[in]  fi     Open file information
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_read(const char            *path,
+           char                  *buffer,
+           size_t                size,
+           off_t                 offset,
+           struct fuse_file_info *fi)
+{
+  nitrofs_entry_t *entry = (nitrofs_entry_t*)fi->fh;
+
+  nitro_count_read(size);
+
+  if(offset < 0)
+    return -EINVAL;
+
+  /* copy the data */
+  return nitro_copy_data(entry, buffer, size, offset);
+}
+
+/*! Describe a read as a range of the NDS file descriptor
+ *
+ *  libfuse can splice such a buffer from the page cache to /dev/fuse
+ *  without the data ever being touched in user space. Only files which
+ *  are presented as stored have such a range.
+ *
+ *  @param[out] buf    Buffer to fill
+ *  @param[in]  entry  File to read
+ *  @param[in]  size   Size to read
+ *  @param[in]  offset Offset to start at
+ */
+static void
+nitro_fd_buf(struct fuse_bufvec *buf,
+             nitrofs_entry_t    *entry,
+             size_t             size,
+             off_t              offset)
+{
+  *buf = FUSE_BUFVEC_INIT(nitro_read_size(entry, size, offset));
+  buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  buf->buf[0].fd    = entry->image->fd;
+  buf->buf[0].pos   = entry->offset + offset;
+}
+
+/*! Read a file into a FUSE buffer (splice mode)
+ *
+ *  @param[in]  path   Path of open file
+ *  @param[out] bufp   Buffer vector to return
+ *  @param[in]  size   Size to read
+ *  @param[in]  offset Offset to start at
+ *  @param[in]  fi     Open file information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_read_buf(const char            *path,
+               struct fuse_bufvec    **bufp,
+               size_t                size,
+               off_t                 offset,
+               struct fuse_file_info *fi)
+{
+  nitrofs_entry_t    *entry = (nitrofs_entry_t*)fi->fh;
+  struct fuse_bufvec *buf;
+  int                rc;
+
+  nitro_count_read(size);
+
+  if(offset < 0)
+    return -EINVAL;
+
+  /* libfuse frees this after replying */
+  buf = (struct fuse_bufvec*)malloc(sizeof(*buf));
+  if(buf == NULL)
+    return -ENOMEM;
+
+  if(nitro_lz_size(entry, NULL) == 0)
+  {
+    nitro_fd_buf(buf, entry, size, offset);
+    *bufp = buf;
+    return 0;
+  }
+
+  /* libfuse frees the memory of a buffer as well, so a cached block can't
+   * be handed out directly; give it a copy. The size is only known once
+   * the data is, since a file may turn out not to decompress after all.
+   */
+  *buf = FUSE_BUFVEC_INIT(size);
+  buf->buf[0].mem = malloc(size);
+  if(buf->buf[0].mem == NULL && size != 0)
+  {
+    free(buf);
+    return -ENOMEM;
+  }
+
+  rc = nitro_copy_data(entry, (char*)buf->buf[0].mem, size, offset);
+  if(rc < 0)
+  {
+    free(buf->buf[0].mem);
+    free(buf);
+    return rc;
+  }
+  buf->buf[0].size = rc;
+
+  *bufp = buf;
+  return 0;
+}
+
+/*! Get the inode number for an entry
+ *
+ *  An entry's address is a stable inode number for as long as the kernel
+ *  knows about it, since every lookup holds a reference on the entry's
+ *  image until the kernel forgets it. The root must be FUSE_ROOT_ID.
+ *
+ *  @param[in] entry Entry to convert
+ *
+ *  @returns inode number
+ */
+static fuse_ino_t
+nitro_ino(nitrofs_entry_t *entry)
+{
+  if(entry == root)
+    return FUSE_ROOT_ID;
+  return (fuse_ino_t)entry;
+}
+
+/*! Get the entry for an inode number
+ *
+ *  @param[in] ino Inode number to convert
+ *
+ *  @returns entry
+ */
+static nitrofs_entry_t*
+nitro_ino_entry(fuse_ino_t ino)
+{
+  if(ino == FUSE_ROOT_ID)
+    return root;
+  return (nitrofs_entry_t*)ino;
+}
+
+/*! Drop the kernel's cached names in the root directory of an image
+ *
+ *  @param[in] image Image whose names to drop (may be NULL)
+ */
+static void
+nitro_invalidate_root(nitro_image_t *image)
+{
+  nitrofs_entry_t *child;
+
+  if(image == NULL || !__atomic_load_n(&image->root->loaded, __ATOMIC_ACQUIRE))
+    return;
+
+  for(child = image->root->children; child != NULL; child = child->next)
+    fuse_lowlevel_notify_inval_entry(nitro_notify, FUSE_ROOT_ID, child->name, child->namelen);
+}
+
+/*! Drop whatever the kernel has cached about an NDS file
+ *
+ *  @param[in] rom   NDS file which changed
+ *  @param[in] old   Image it used to have (may be NULL)
+ *  @param[in] image Image it has now (may be NULL)
+ */
+static void
+nitro_invalidate(nitro_rom_t   *rom,
+                 nitro_image_t *old,
+                 nitro_image_t *image)
+{
+  if(nitro_notify == NULL)
+    return;
+
+  /* the root can't be dropped, so drop each name in it, old and new */
+  if(rom->mount == root)
+  {
+    nitro_invalidate_root(old);
+    nitro_invalidate_root(image);
+    fuse_lowlevel_notify_inval_inode(nitro_notify, FUSE_ROOT_ID, 0, 0);
+    return;
+  }
+
+  /* dropping a mount directory drops everything below it */
+  fuse_lowlevel_notify_inval_entry(nitro_notify, FUSE_ROOT_ID,
+                                   rom->mount->name, rom->mount->namelen);
+  if(nitro_opts.lowlevel)
+    fuse_lowlevel_notify_inval_inode(nitro_notify, nitro_ino(rom->mount), 0, 0);
+}
+
+/*! Replace the image of an NDS file which has changed
+ *
+ *  The new image is loaded in the background while the old one is still
+ *  served. If the new file can't be loaded (it may still be being
+ *  written) the old image stays. Otherwise the old image is swapped out
+ *  and lives on until nothing refers to it any more.
+ *
+ *  The old image only keeps its old contents if the NDS file was replaced
+ *  by a rename, or was copied into memory (-o preload or -o hugepages,
+ *  without -o splice). A mapping doesn't snapshot a file rewritten in
+ *  place, so handles opened before the reload then see the new data mixed
+ *  with their old tree, or SIGBUS if the file shrank.
+ *
+ *  @param[in,out] rom NDS file which changed
+ */
+static void
+nitro_reload_rom(nitro_rom_t *rom)
+{
+  nitro_image_t *image, *old;
+  struct stat   st;
+
+  pthread_mutex_lock(&rom->lock);
+
+  /* not loaded yet; it will be loaded from the new file on first use */
+  old = rom->image;
+  if(old == NULL)
+  {
+    if(stat(rom->file, &st) == 0)
+    {
+      rom->atime = st.st_atime;
+      rom->mtime = st.st_mtime;
+      rom->ctime = st.st_ctime;
+    }
+    rom->broken = 0;
+    pthread_mutex_unlock(&rom->lock);
+
+    nitro_invalidate(rom, NULL, NULL);
+    return;
+  }
+
+  image = nitro_new_image(rom);
+  if(image == NULL)
+  {
+    pthread_mutex_unlock(&rom->lock);
+    return;
+  }
+
+  /* the old image is still served by open handles */
+  if(image->dev == old->dev && image->ino == old->ino
+  && (!old->copied || nitro_opts.splice))
+    fprintf(stderr, "%s: rewritten in place; files opened before now may read "
+                    "torn data. Replace it by renaming a new file over it, or "
+                    "mount with -o preload\n", rom->file);
+
+  /* swap, then wait for any reader which saw the old image to take its
+   * reference
+   */
+  __atomic_store_n(&rom->image, image, __ATOMIC_SEQ_CST);
+  while(__atomic_load_n(&rom->pins, __ATOMIC_SEQ_CST) != 0)
+    sched_yield();
+  pthread_mutex_unlock(&rom->lock);
+
+  nitro_invalidate(rom, old, image);
+
+  /* drop the reference the NDS file held */
+  nitro_image_put(old, 1);
+}
+
+/*! inotify descriptor watching the NDS files' directory */
+static int       nitro_watch_fd = -1;
+/*! Thread reading nitro_watch_fd */
+static pthread_t nitro_watch_thread;
+
+/*! Find the NDS file with a given name
+ *
+ *  @param[in] name NDS file name without its directory
+ *
+ *  @returns NDS file
+ *  @returns NULL if no NDS file has that name
+ */
+static nitro_rom_t*
+nitro_find_rom(const char *name)
+{
+  nitrofs_entry_t *mount;
+
+  if(root->rom != NULL)
+    return strcmp(root->rom->base, name) == 0 ? root->rom : NULL;
+
+  mount = nitro_lookup(root, name, strlen(name));
+  return mount != NULL ? mount->rom : NULL;
+}
+
+/*! Watcher thread; reloads NDS files as they are rewritten
+ *
+ *  @param[in] arg Unused
+ *
+ *  @returns NULL
+ */
+static void*
+nitro_watch(void *arg)
+{
+  char    buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char    *p;
+  ssize_t len;
+
+  for(;;)
+  {
+    len = read(nitro_watch_fd, buffer, sizeof(buffer));
+    if(len < 0 && errno == EINTR)
+      continue;
+    if(len <= 0)
+      break;
+
+    /* don't get cancelled halfway through a reload */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for(p = buffer; p < buffer + len; )
+    {
+      const struct inotify_event *event = (const struct inotify_event*)p;
+      nitro_rom_t                *rom;
+
+      p += sizeof(*event) + event->len;
+      if(event->len == 0)
+        continue;
+
+      rom = nitro_find_rom(event->name);
+      if(rom != NULL)
+        nitro_reload_rom(rom);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  return NULL;
+}
+
+/*! Start watching the NDS files for changes, if enabled
+ *
+ *  The directory is watched rather than the files, so that files replaced
+ *  by a rename are noticed too.
+ */
+static void
+nitro_start_watch(void)
+{
+  const char *file = nds_file;
+  char       *dir;
+  sigset_t   all, old;
+
+  if(!nitro_opts.watch || nitro_watch_fd >= 0)
+    return;
+
+  /* in single mode, watch the directory containing the NDS file */
+  if(nitro_opts.multi)
+    dir = strdup(file);
+  else if(roms->base == roms->file)
+    dir = strdup(".");
+  else if(roms->base == roms->file + 1)
+    dir = strdup("/");
+  else
+    dir = strndup(roms->file, roms->base - roms->file - 1);
+
+  nitro_watch_fd = inotify_init1(IN_CLOEXEC);
+  if(dir == NULL || nitro_watch_fd < 0
+  || inotify_add_watch(nitro_watch_fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) < 0)
+  {
+    perror("inotify");
+    if(nitro_watch_fd >= 0)
+      close(nitro_watch_fd);
+    nitro_watch_fd = -1;
+    free(dir);
+    return;
+  }
+  free(dir);
+
+  /* leave signals to the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if(pthread_create(&nitro_watch_thread, NULL, nitro_watch, NULL) != 0)
+  {
+    close(nitro_watch_fd);
+    nitro_watch_fd = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*! Stop watching the NDS files */
+static void
+nitro_stop_watch(void)
+{
+  if(nitro_watch_fd < 0)
+    return;
+
+  pthread_cancel(nitro_watch_thread);
+  pthread_join(nitro_watch_thread, NULL);
+  close(nitro_watch_fd);
+  nitro_watch_fd = -1;
+}
+
+/*! Negotiate connection capabilities
+ *
+ *  @param[in,out] conn Connection information
+ */
+static void
+nitro_init_conn(struct fuse_conn_info *conn)
+{
+  /* let libfuse splice read replies from the NDS file */
+  if(nitro_opts.splice)
+  {
+    if(conn->capable & FUSE_CAP_SPLICE_WRITE)
+      conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if(conn->capable & FUSE_CAP_SPLICE_MOVE)
+      conn->want |= FUSE_CAP_SPLICE_MOVE;
+  }
+
+  /* the kernel offers its largest read-ahead, which can only be lowered */
+  if(nitro_opts.max_readahead != 0 && nitro_opts.max_readahead < conn->max_readahead)
+    conn->max_readahead = nitro_opts.max_readahead;
+
+#if FUSE_USE_VERSION >= 30
+  /* this must match the max_read mount option added in main */
+  if(nitro_opts.max_read != 0)
+    conn->max_read = nitro_opts.max_read;
+#endif
+
+  /* libfuse 3 derives max_pages, and so the largest read, from max_write,
+   * which it starts at the size of its receive buffer; leave it there
+   */
+  nitro_stats.ra    = conn->max_readahead;
+  nitro_stats.write = conn->max_write;
+}
+
+#if FUSE_USE_VERSION >= 30
+/*! Initialize filesystem
+ *
+ *  @param[in,out] conn Connection information
+ *  @param[in,out] cfg  Library configuration
+ *
+ *  @returns private data (unused)
+ */
+static void*
+nitro_init(struct fuse_conn_info *conn,
+           struct fuse_config    *cfg)
+{
+  nitro_init_conn(conn);
+
+  /* operations on open files and directories only need fi->fh */
+  cfg->nullpath_ok = 1;
+
+  /* notifications go through the low-level session */
+  nitro_notify = fuse_get_session(fuse_get_context()->fuse);
+  nitro_start_watch();
+  return NULL;
+}
+#else
+/*! Initialize filesystem
+ *
+ *  @param[in,out] conn Connection information
+ *
+ *  @returns private data (unused)
+ */
+static void*
+nitro_init(struct fuse_conn_info *conn)
+{
+  struct fuse_session *se = fuse_get_session(fuse_get_context()->fuse);
+
+  nitro_init_conn(conn);
+
+  /* notifications go through the low-level channel */
+  nitro_notify = fuse_session_next_chan(se, NULL);
+  nitro_start_watch();
+  return NULL;
+}
+#endif
+
+/*! Open a directory
+ *
+ *  @param[in]  path Path to open
+ *  @param[out] fi   Open directory information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+nitro_opendir(const char            *path,
+              struct fuse_file_info *fi)
+{
+  nitrofs_entry_t *entry;
+  nitro_image_t   *pin;
+  int             rc = 0;
+
+  nitro_count(&nitro_stats.opendir);
+
+  /* lookup the path */
+  entry = nitro_traverse_path(path, &pin);
+  if(entry == NULL)
+    rc = -ENOENT;
+  /* make sure this is a directory */
+  else if(entry->type != NITRO_DIR_TYPE)
+    rc = -EISDIR;
+  else
+    rc = nitro_open_dir(entry, fi);
+
+  nitro_image_put(pin, 1);
+  return rc;
+}
+
+/*! Release an open directory
+ *
+ *  @param[in] path Unused
+ *  @param[in] fi   Open directory information
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_releasedir(const char            *path,
+                 struct fuse_file_info *fi)
+{
+  nitro_close_dir(fi);
+  return 0;
+}
+
+/*! Release an open file
+ *
+ *  @param[in] path Unused
+ *  @param[in] fi   Open file information
+ *
+ *  @returns 0 for success
+ */
+static int
+nitro_release(const char            *path,
+              struct fuse_file_info *fi)
+{
+  nitro_file_closed((nitrofs_entry_t*)fi->fh);
+  nitro_entry_put((nitrofs_entry_t*)fi->fh, 1);
+  return 0;
+}
+
+/*! Cleanup after unmount
+ *
+ *  @param[in] data Unused
+ */
+static void
+nitro_destroy(void *data)
+{
+  nitro_stop_watch();
+  nitro_notify = NULL;
+
+  if(nitro_opts.stats)
+    nitro_print_stats(stderr);
+  nitro_free_roms();
+}
+
+/*! NitroFS FUSE operations */
+static const struct fuse_operations nitro_ops =
+{
+#if FUSE_USE_VERSION >= 30
+  .getattr          = nitro_getattr3,
+  .readdir          = nitro_readdir3,
+#else
+  .getattr          = nitro_getattr,
+  .readdir          = nitro_readdir,
+#endif
+  .open             = nitro_open,
+  .read             = nitro_read,
+  .opendir          = nitro_opendir,
+  .release          = nitro_release,
+  .releasedir       = nitro_releasedir,
+  .init             = nitro_init,
+  .destroy          = nitro_destroy,
+#if FUSE_USE_VERSION < 30
+  .flag_nullpath_ok = 1,
+  .flag_nopath      = 1,
+#endif
+};
+
+/*! Look up a directory entry by name
+ *
+ *  @param[in] req    Request handle
+ *  @param[in] parent Inode of the parent directory
+ *  @param[in] name   Name to look up
+ */
+static void
+nitro_ll_lookup(fuse_req_t req,
+                fuse_ino_t parent,
+                const char *name)
+{
+  struct fuse_entry_param e;
+  nitrofs_entry_t         *entry;
+  nitro_image_t           *pin = NULL;
+
+  nitro_count(&nitro_stats.lookup);
+
+  memset(&e, 0, sizeof(e));
+  entry = nitro_resolve(nitro_ino_entry(parent), &pin);
+  if(entry != NULL)
+    entry = nitro_lookup(entry, name, strlen(name));
+
+  if(entry == NULL)
+  {
+    /* a zero inode lets the kernel cache the failure */
+    e.entry_timeout = nitro_opts.negative_timeout;
+  }
+  else
+  {
+    /* the kernel holds a reference until it forgets the inode */
+    nitro_entry_get(entry, 1);
+    e.ino           = nitro_ino(entry);
+    e.entry_timeout = nitro_opts.entry_timeout;
+    e.attr_timeout  = nitro_fill_stat(entry, &e.attr, 0) ? nitro_opts.attr_timeout : 0;
+  }
+
+  fuse_reply_entry(req, &e);
+  nitro_image_put(pin, 1);
+}
+
+/*! Forget an inode
+ *
+ *  @param[in] req     Request handle
+ *  @param[in] ino     Inode to forget
+ *  @param[in] nlookup Number of lookups to forget
+ */
+static void
+nitro_ll_forget(fuse_req_t       req,
+                fuse_ino_t       ino,
+                nitro_nlookup_t nlookup)
+{
+  nitro_entry_put(nitro_ino_entry(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+/*! Get attributes
+ *
+ *  @param[in] req Request handle
+ *  @param[in] ino Inode to stat
+ *  @param[in] fi  Unused
+ */
+static void
+nitro_ll_getattr(fuse_req_t            req,
+                 fuse_ino_t            ino,
+                 struct fuse_file_info *fi)
+{
+  struct stat st;
+
+  nitro_count(&nitro_stats.getattr);
+
+  if(nitro_fill_stat(nitro_ino_entry(ino), &st, 0))
+    fuse_reply_attr(req, &st, nitro_opts.attr_timeout);
+  else
+    fuse_reply_attr(req, &st, 0);
+}
+
+/*! Open a directory
+ *
+ *  @param[in]  req Request handle
+ *  @param[in]  ino Inode to open
+ *  @param[out] fi  Open directory information
+ */
+static void
+nitro_ll_opendir(fuse_req_t            req,
+                 fuse_ino_t            ino,
+                 struct fuse_file_info *fi)
+{
+  nitrofs_entry_t *entry = nitro_ino_entry(ino);
+  int             rc;
+
+  nitro_count(&nitro_stats.opendir);
+
+  /* make sure this is a directory */
+  if(entry->type != NITRO_DIR_TYPE)
+  {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  rc = nitro_open_dir(entry, fi);
+  if(rc != 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_open(req, fi);
+}
+
+/*! Fill a directory listing
+ *
+ *  @param[in] req    Request handle
+ *  @param[in] size   Maximum size to reply with
+ *  @param[in] offset Directory offset
+ *  @param[in] fi     Open directory information
+ *  @param[in] plus   Whether to return each entry's attributes (FUSE 3)
+ */
+static void
+nitro_ll_list(fuse_req_t            req,
+              size_t                size,
+              off_t                 offset,
+              struct fuse_file_info *fi,
+              int                   plus)
+{
+  struct fuse_entry_param e;
+  off_t                   off;
+  size_t                  pos = 0, len;
+  char                    *buffer;
+
+  /* we set up this handle in nitro_ll_opendir */
+  nitro_dir_t     *handle = (nitro_dir_t*)fi->fh;
+  nitrofs_entry_t *entry = handle->dir;
+  nitrofs_entry_t *stat_entry;
+  const char      *name;
+
+  nitro_count(&nitro_stats.readdir);
+
+  buffer = (char*)malloc(size);
+  if(buffer == NULL)
+  {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  memset(&e, 0, sizeof(e));
+  e.entry_timeout = nitro_opts.entry_timeout;
+
+  /* offset 0 means '.', offset 1 means '..', the rest are children; they
+   * are contiguous, so start straight at the desired offset
+   */
+  for(off = offset > 0 ? offset : 0; ; ++off)
+  {
+    if(off == 0)
+    {
+      stat_entry = handle->entry;
+      name       = ".";
+    }
+    else if(off == 1)
+    {
+      stat_entry = nitro_mount_point(handle->entry->parent);
+      name       = "..";
+    }
+    else if(off - 2 < entry->nchildren)
+    {
+      stat_entry = &entry->children[off - 2];
+      name       = stat_entry->name;
+    }
+    else
+      break;
+
+    /* stop once the buffer is full */
+    e.attr_timeout = nitro_fill_stat(stat_entry, &e.attr, 0) ? nitro_opts.attr_timeout : 0;
+#if FUSE_USE_VERSION >= 30
+    if(plus)
+    {
+      e.ino = nitro_ino(stat_entry);
+      len = fuse_add_direntry_plus(req, buffer + pos, size - pos, name, &e, off + 1);
+      if(len > size - pos)
+        break;
+
+      /* the kernel holds a reference to every entry but . and .. as if it
+       * had been looked up, until it forgets the inode
+       */
+      if(off >= 2)
+        nitro_entry_get(stat_entry, 1);
+    }
+    else
+#endif
+    {
+      len = fuse_add_direntry(req, buffer + pos, size - pos, name, &e.attr, off + 1);
+      if(len > size - pos)
+        break;
+    }
+    pos += len;
+  }
+
+  fuse_reply_buf(req, buffer, pos);
+  free(buffer);
+}
+
+/*! Read a directory
+ *
+ *  @param[in] req    Request handle
+ *  @param[in] ino    Inode of the directory
+ *  @param[in] size   Maximum size to reply with
+ *  @param[in] offset Directory offset
+ *  @param[in] fi     Open directory information
+ */
+static void
+nitro_ll_readdir(fuse_req_t            req,
+                 fuse_ino_t            ino,
+                 size_t                size,
+                 off_t                 offset,
+                 struct fuse_file_info *fi)
+{
+  nitro_ll_list(req, size, offset, fi, 0);
+}
+
+#if FUSE_USE_VERSION >= 30
+/*! Read a directory along with each entry's attributes
+ *
+ *  This saves the kernel a lookup per entry when a listing is followed by
+ *  a stat of everything in it, as with ls -l, find and rsync.
+ *
+ *  @param[in] req    Request handle
+ *  @param[in] ino    Inode of the directory
+ *  @param[in] size   Maximum size to reply with
+ *  @param[in] offset Directory offset
+ *  @param[in] fi     Open directory information
+ */
+static void
+nitro_ll_readdirplus(fuse_req_t            req,
+                     fuse_ino_t            ino,
+                     size_t                size,
+                     off_t                 offset,
+                     struct fuse_file_info *fi)
+{
+  nitro_ll_list(req, size, offset, fi, 1);
+}
+#endif
+
+/*! Open a file
+ *
+ *  @param[in]  req Request handle
+ *  @param[in]  ino Inode to open
+ *  @param[out] fi  Open file information
+ */
+static void
+nitro_ll_open(fuse_req_t            req,
+              fuse_ino_t            ino,
+              struct fuse_file_info *fi)
+{
+  nitrofs_entry_t *entry = nitro_ino_entry(ino);
+
+  nitro_count(&nitro_stats.open);
+
+  /* don't allow opening directories as files */
+  if(entry->type == NITRO_DIR_TYPE)
+  {
+    fuse_reply_err(req, EISDIR);
+    return;
+  }
+
+  /* don't allow write mode */
+  if((fi->flags & O_ACCMODE) != O_RDONLY)
+  {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  /* the open file keeps its image alive, and the image never changes, so
+   * keep whatever the kernel has cached
+   */
+  nitro_entry_get(entry, 1);
+  nitro_file_opened(entry);
+  fi->fh         = (unsigned long)entry;
+  fi->keep_cache = 1;
+  fuse_reply_open(req, fi);
+  nitro_prefetch(entry);
+}
+
+/*! Release an open file
+ *
+ *  @param[in] req Request handle
+ *  @param[in] ino Inode of the file
+ *  @param[in] fi  Open file information
+ */
+static void
+nitro_ll_release(fuse_req_t            req,
+                 fuse_ino_t            ino,
+                 struct fuse_file_info *fi)
+{
+  nitro_file_closed((nitrofs_entry_t*)fi->fh);
+  nitro_entry_put((nitrofs_entry_t*)fi->fh, 1);
+  fuse_reply_err(req, 0);
+}
+
+/*! Release an open directory
+ *
+ *  @param[in] req Request handle
+ *  @param[in] ino Inode of the directory
+ *  @param[in] fi  Open directory information
+ */
+static void
+nitro_ll_releasedir(fuse_req_t            req,
+                    fuse_ino_t            ino,
+                    struct fuse_file_info *fi)
+{
+  nitro_close_dir(fi);
+  fuse_reply_err(req, 0);
+}
+
+/*! Read a file
+ *
+ *  @param[in] req    Request handle
+ *  @param[in] ino    Inode of the file
+ *  @param[in] size   Size to read
+ *  @param[in] offset Offset to start at
+ *  @param[in] fi     Open file information
+ */
+static void
+nitro_ll_read(fuse_req_t            req,
+              fuse_ino_t            ino,
+              size_t                size,
+              off_t                 offset,
+              struct fuse_file_info *fi)
+{
+  nitrofs_entry_t     *entry = (nitrofs_entry_t*)fi->fh;
+  const unsigned char *data;
+  nitro_block_t       *blk;
+
+  nitro_count_read(size);
+
+  if(offset < 0)
+  {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  if(nitro_opts.splice && nitro_lz_size(entry, NULL) == 0)
+  {
+    struct fuse_bufvec buf;
+
+    /* reply with a range of the NDS file; libfuse can splice this */
+    nitro_fd_buf(&buf, entry, size, offset);
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+    return;
+  }
+
+  data = nitro_file_data(entry, &blk);
+  if(data == NULL)
+  {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  /* reply straight from the mapping or cache block; no intermediate copy */
+  size = nitro_read_size(entry, size, offset);
+  fuse_reply_buf(req, (const char*)data + offset, size);
+  nitro_cache_release(blk);
+}
+
+/*! Initialize filesystem
+ *
+ *  @param[in]     data Unused
+ *  @param[in,out] conn Connection information
+ */
+static void
+nitro_ll_init(void                  *data,
+              struct fuse_conn_info *conn)
+{
+  nitro_init_conn(conn);
+  nitro_start_watch();
+}
+
+/*! Cleanup after unmount
  *
- *  @param[in] dir Tree to destroy
+ *  @param[in] data Unused
  */
 static void
-nitro_destroy_tree(nitrofs_entry_t *dir)
+nitro_ll_destroy(void *data)
 {
-  nitrofs_entry_t *child, *next;
+  nitro_destroy(data);
+}
 
-  /* iterate through the children */
-  for(child = dir->children; child != NULL; child = next)
-  {
-    next = child->next;
+/*! NitroFS FUSE low-level operations */
+static const struct fuse_lowlevel_ops nitro_ll_ops =
+{
+  .lookup      = nitro_ll_lookup,
+  .forget      = nitro_ll_forget,
+  .getattr     = nitro_ll_getattr,
+  .opendir     = nitro_ll_opendir,
+  .readdir     = nitro_ll_readdir,
+#if FUSE_USE_VERSION >= 30
+  .readdirplus = nitro_ll_readdirplus,
+#endif
+  .releasedir  = nitro_ll_releasedir,
+  .open        = nitro_ll_open,
+  .read        = nitro_ll_read,
+  .release     = nitro_ll_release,
+  .init        = nitro_ll_init,
+  .destroy     = nitro_ll_destroy,
+};
 
-    /* recurse */
-    nitro_destroy_tree(child);
-  }
+/*! Worker pool state */
+typedef struct
+{
+  struct fuse_session *se;     /*!< Session being served */
+  sem_t               finish;  /*!< Posted when a worker exits */
+} nitro_pool_t;
 
-  /* clean up self */
-  free(dir);
+#if FUSE_USE_VERSION >= 30
+/*! Free a worker's request buffer
+ *
+ *  @param[in] arg Request buffer
+ */
+static void
+nitro_free_buf(void *arg)
+{
+  free(((struct fuse_buf*)arg)->mem);
 }
 
-/*! Build a tree
+/*! Worker thread; receives and processes requests until the session ends
  *
- *  @returns 0 for success
+ *  @param[in] arg Worker pool
+ *
+ *  @returns NULL
  */
-static int
-nitro_build_tree(void)
+static void*
+nitro_worker(void *arg)
 {
-  fnt_main_entry_t entry;
-
-  /* allocate root node */
-  root = (nitrofs_entry_t*)malloc(sizeof(nitrofs_entry_t));
-  if(root == NULL)
-    return -1;
+  nitro_pool_t    *pool = (nitro_pool_t*)arg;
+  struct fuse_buf fbuf = { .mem = NULL, };
 
-  /* initialize root directory */
-  nitro_init_dir(root, root, NITRO_ROOT);
+  /* only allow cancellation while waiting for a request */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-  /* copy FNT entry */
-  memcpy(&entry, nds_mapping + fnt_offset, sizeof(entry));
+  /* libfuse allocates the buffer on the first request and reuses it */
+  pthread_cleanup_push(nitro_free_buf, &fbuf);
 
-  /* fill in its children */
-  if(nitro_build_subdir(root, &entry) != 0)
+  while(!fuse_session_exited(pool->se))
   {
-    /* a failure; clean up */
-    nitro_destroy_tree(root);
-    return -1;
+    int res;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    res = fuse_session_receive_buf(pool->se, &fbuf);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    if(res == -EINTR)
+      continue;
+    if(res <= 0)
+      break;
+
+    fuse_session_process_buf(pool->se, &fbuf);
   }
-  return 0;
-}
 
-/*! Fill a stat struct from an entry
- *
- *  @param[in]  entry Entry to use
- *  @param[out] st    Buffer to fill
- */
-static void
-nitro_fill_stat(nitrofs_entry_t *entry,
-                struct stat     *st)
-{
-  st->st_dev     = 0;
-  st->st_ino     = ((uint32_t)entry->parent->id << 8) | entry->id;
-  st->st_nlink   = entry->links;
-  st->st_uid     = getuid();
-  st->st_gid     = getgid();
-  st->st_rdev    = 0;
-  st->st_size    = entry->size;
-  st->st_blksize = 4096;
-  st->st_blocks  = (st->st_size + st->st_blksize-1) / st->st_blksize;
-  st->st_atime   = nds_atime;
-  st->st_mtime   = nds_mtime;
-  st->st_ctime   = nds_ctime;
-  if(entry->type == NITRO_DIR_TYPE)
-    st->st_mode = NITRO_DIR_MODE;
-  else
-    st->st_mode = NITRO_FILE_MODE;
-}
+  pthread_cleanup_pop(1);
 
-/*! Traverse path to get entry
+  /* bring the rest of the pool down with us */
+  fuse_session_exit(pool->se);
+  sem_post(&pool->finish);
+  return NULL;
+}
+#else
+/*! Worker thread; receives and processes requests until the session ends
  *
- *  @param[in] path Path to traverse
+ *  @param[in] arg Worker pool
  *
- *  @returns entry that was found
- *  @returns NULL for no entry
+ *  @returns NULL
  */
-static nitrofs_entry_t*
-nitro_traverse_path(const char *path)
+static void*
+nitro_worker(void *arg)
 {
-  const char      *p;
-  nitrofs_entry_t *dir = root, *entry;
+  nitro_pool_t     *pool = (nitro_pool_t*)arg;
+  struct fuse_chan *ch = fuse_session_next_chan(pool->se, NULL);
+  size_t           bufsize = fuse_chan_bufsize(ch);
+  char             *mem;
 
-  /* special case; this is the root directory */
-  if(strcmp(path, "/") == 0)
-    return root;
+  /* only allow cancellation while waiting for a request */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-  /* iterate through intermediate path components */
-  p = strchr(++path, '/');
-  while(p != NULL)
+  mem = (char*)malloc(bufsize);
+  if(mem != NULL)
   {
-    /* look at each child for a match */
-    for(entry = dir->children; entry != NULL; entry = entry->next)
+    pthread_cleanup_push(free, mem);
+
+    while(!fuse_session_exited(pool->se))
     {
-      /* check if the name matches */
-      if(strlen(entry->name) == p-path && memcmp(path, entry->name, p-path) == 0)
-      {
-        /* we found a match; stop looking at these children */
-        dir = entry;
+      struct fuse_chan *tmpch = ch;
+      struct fuse_buf  fbuf = { .mem = mem, .size = bufsize, };
+      int              res;
+
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+      res = fuse_session_receive_buf(pool->se, &fbuf, &tmpch);
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+      if(res == -EINTR)
+        continue;
+      if(res <= 0)
         break;
-      }
-    }
 
-    /* move to the next component */
-    path = ++p;
-    p = strchr(path, '/');
-  }
+      fuse_session_process_buf(pool->se, &fbuf, tmpch);
+    }
 
-  /* we are at the final component; look at each child for a match */
-  for(entry = dir->children; entry != NULL; entry = entry->next)
-  {
-    /* check if the name matches */
-    if(strcmp(path, entry->name) == 0)
-      return entry;
+    pthread_cleanup_pop(1);
   }
 
-  /* didn't find this entry */
+  /* bring the rest of the pool down with us */
+  fuse_session_exit(pool->se);
+  sem_post(&pool->finish);
   return NULL;
 }
+#endif
 
-/*! Get attributes
+/*! Serve a session with a fixed number of worker threads
  *
- *  @param[in]  path Path to lookup
- *  @param[out] st   Buffer to fill
+ *  @param[in] se       Session to serve
+ *  @param[in] nthreads Number of worker threads
  *
  *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns -1 for failure
  */
 static int
-nitro_getattr(const char  *path,
-              struct stat *st)
+nitro_session_loop(struct fuse_session *se,
+                   unsigned int        nthreads)
 {
-  nitrofs_entry_t *entry;
+  nitro_pool_t pool;
+  pthread_t    *threads;
+  sigset_t     all, old;
+  unsigned int i, started;
 
-  entry = nitro_traverse_path(path);
-  if(entry == NULL)
-    return -ENOENT;
+  threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+  if(threads == NULL)
+    return -1;
 
-  nitro_fill_stat(entry, st);
-  return 0;
+  pool.se = se;
+  sem_init(&pool.finish, 0, 0);
+
+  /* workers inherit a blocked signal mask; the main thread handles them */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for(started = 0; started < nthreads; ++started)
+  {
+    if(pthread_create(&threads[started], NULL, nitro_worker, &pool) != 0)
+      break;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  /* wait until a signal or a worker ends the session */
+  if(started == 0)
+    fuse_session_exit(se);
+  while(!fuse_session_exited(se))
+    sem_wait(&pool.finish);
+
+  /* stop the workers */
+  for(i = 0; i < started; ++i)
+    pthread_cancel(threads[i]);
+  for(i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  sem_destroy(&pool.finish);
+  free(threads);
+  fuse_session_reset(se);
+
+  return started == 0 ? -1 : 0;
 }
 
-/*! Read a directory
+#if FUSE_USE_VERSION >= 30
+/*! Handle the informational libfuse command-line options
  *
- *  @param[in]  path   Directory to read
- *  @param[out] buffer Buffer to fill
- *  @param[in]  filler Callback which fills buffer
- *  @param[in]  offset Directory offset
- *  @param[in]  fi     Open directory information
+ *  @param[in] args Command-line arguments
+ *  @param[in] opts Parsed libfuse options
  *
- *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns -1 to go on and mount
+ *  @returns exit status otherwise
  */
 static int
-nitro_readdir(const char            *path,
-              void                  *buffer,
-              fuse_fill_dir_t       filler,
-              off_t                 offset,
-              struct fuse_file_info *fi)
+nitro_cmdline_info(struct fuse_args               *args,
+                   const struct fuse_cmdline_opts *opts)
 {
-  struct stat     st;
-  off_t           off;
-
-  /* we set up this entry pointer in nitro_opendir */
-  nitrofs_entry_t *entry = (nitrofs_entry_t*)fi->fh;
-  nitrofs_entry_t *child;
-
-  /* offset 0 means '.' */
-  if(offset == 0)
+  if(opts->show_help)
   {
-    nitro_fill_stat(entry, &st);
-    if(filler(buffer, ".", &st, ++offset))
-      return 0;
+    printf("usage: %s [options] <nds_file> <mountpoint>\n\n", args->argv[0]);
+    fuse_cmdline_help();
+    if(nitro_opts.lowlevel)
+      fuse_lowlevel_help();
+    else
+      fuse_lib_help(args);
+    return 0;
   }
 
-  /* offset 1 means '..' */
-  if(offset == 1)
+  if(opts->show_version)
   {
-    nitro_fill_stat(entry->parent, &st);
-    if(filler(buffer, "..", &st, ++offset))
-      return 0;
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    return 0;
   }
 
-  /* skip until we reach the desired offset */
-  for(off = 2, child = entry->children; child != NULL; child = child->next, ++off)
+  if(opts->mountpoint == NULL)
   {
-    if(off == offset)
-    {
-      /* we have reached the desired offset; start filling */
-      nitro_fill_stat(child, &st);
-      if(filler(buffer, child->name, &st, ++offset))
-        return 0;
-    }
+    fprintf(stderr, "%s: no mountpoint specified\n", args->argv[0]);
+    return 1;
   }
 
-  return 0;;
+  return -1;
 }
 
-/*! Open a file
+/*! Run the FUSE high-level loop
  *
- *  @param[in]  path File to open
- *  @param[out] fi   Open file information
+ *  @param[in] args Command-line arguments
+ *  @param[in] ops  FUSE operations
  *
  *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns 1 for failure
  */
 static int
-nitro_open(const char            *path,
-           struct fuse_file_info *fi)
+nitro_hl_main(struct fuse_args             *args,
+              const struct fuse_operations *ops)
 {
-  nitrofs_entry_t *entry;
+  struct fuse_cmdline_opts opts;
+  struct fuse              *fuse;
+  struct fuse_session      *se;
+  int                      rc;
 
-  /* lookup the path */
-  entry = nitro_traverse_path(path);
-  if(entry == NULL)
+  /* without an explicit worker count, let libfuse decide; its pool
+   * honors -o clone_fd and -o max_idle_threads=N
+   */
+  if(nitro_opts.threads == 0)
+    return fuse_main(args->argc, args->argv, ops, NULL);
+
+  if(fuse_parse_cmdline(args, &opts) != 0)
+    return 1;
+  if((rc = nitro_cmdline_info(args, &opts)) >= 0)
   {
-    /* we didn't find it. if O_CREAT was specified, return EROFS */
-    if(fi->flags & O_CREAT)
-      return -EROFS;
-    /* otherwise, return ENOENT */
-    return -ENOENT;
+    free(opts.mountpoint);
+    return rc;
   }
 
-  /* don't allow write mode */
-  if((fi->flags & O_ACCMODE) == O_RDWR)
-    return -EACCES;
-  if((fi->flags & O_ACCMODE) == O_WRONLY)
-    return -EACCES;
+  rc = -1;
+  fuse = fuse_new(args, ops, sizeof(*ops), NULL);
+  if(fuse != NULL)
+  {
+    se = fuse_get_session(fuse);
+    if(fuse_mount(fuse, opts.mountpoint) == 0)
+    {
+      if(fuse_daemonize(opts.foreground) == 0
+      && fuse_set_signal_handlers(se) == 0)
+      {
+        if(opts.singlethread)
+          rc = fuse_loop(fuse);
+        else
+          rc = nitro_session_loop(se, nitro_opts.threads);
 
-  /* set the open file info to point to our found entry */
-  fi->fh = (unsigned long)entry;
-  return 0;
+        fuse_remove_signal_handlers(se);
+      }
+      fuse_unmount(fuse);
+    }
+    fuse_destroy(fuse);
+  }
+
+  free(opts.mountpoint);
+
+  return rc == 0 ? 0 : 1;
 }
 
-/*! Read a file
+/*! Run the FUSE low-level loop
  *
- *  @param[in]  path   Path of open file
- *  @param[out] buffer Buffer to fill
- *  @param[in]  size   Size to fill
- *  @param[in]  offset Offset to start at
+ *  @param[in] args Command-line arguments
  *
- *  @returns number of bytes read
- *  @returns negated errno otherwise
+ *  @returns 0 for success
+ *  @returns 1 for failure
  */
 static int
-nitro_read(const char            *path,
-           char                  *buffer,
-           size_t                size,
-           off_t                 offset,
-           struct fuse_file_info *fi)
+nitro_ll_main(struct fuse_args *args)
 {
-  nitrofs_entry_t *entry = (nitrofs_entry_t*)fi->fh;
-  fat_entry_t     fat_entry;
+  struct fuse_cmdline_opts opts;
+  struct fuse_session      *se;
+  int                      rc;
 
-  if(offset < 0)
-    return -EINVAL;
+  if(fuse_parse_cmdline(args, &opts) != 0)
+    return 1;
+  if((rc = nitro_cmdline_info(args, &opts)) >= 0)
+  {
+    free(opts.mountpoint);
+    return rc;
+  }
 
-  /* past end-of-file; return 0 bytes read */
-  if(offset >= entry->size)
-    return 0;
+  /* create a session */
+  rc = -1;
+  se = fuse_session_new(args, &nitro_ll_ops, sizeof(nitro_ll_ops), NULL);
+  if(se != NULL)
+  {
+    if(fuse_set_signal_handlers(se) == 0)
+    {
+      /* mount the filesystem */
+      if(fuse_session_mount(se, opts.mountpoint) == 0)
+      {
+        nitro_notify = se;
 
-  /* copy the FAT entry */
-  memcpy(&fat_entry, nds_mapping + fat_offset + (entry->id * sizeof(fat_entry)),
-         sizeof(fat_entry));
+        /* run the session loop */
+        if(fuse_daemonize(opts.foreground) == 0)
+        {
+          if(opts.singlethread)
+            rc = fuse_session_loop(se);
+          else if(nitro_opts.threads == 0)
+          {
+            /* libfuse's pool, with -o clone_fd and -o max_idle_threads=N */
+#if FUSE_USE_VERSION >= 32
+            struct fuse_loop_config config =
+            {
+              .clone_fd         = opts.clone_fd,
+              .max_idle_threads = opts.max_idle_threads,
+            };
 
-  /* if they want to read past end-of-file, truncate the amount to read */
-  if(offset + size > entry->size)
-    size = entry->size - offset;
+            rc = fuse_session_loop_mt(se, &config);
+#else
+            rc = fuse_session_loop_mt(se, opts.clone_fd);
+#endif
+          }
+          else
+            rc = nitro_session_loop(se, nitro_opts.threads);
+        }
 
-  /* copy the data */
-  memcpy(buffer, nds_mapping + fat_entry.start_offset, size);
+        fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+  }
 
-  /* return number of bytes copied */
-  return size;
-}
+  /* clean up */
+  free(opts.mountpoint);
 
-/*! Open a directory
+  return rc == 0 ? 0 : 1;
+}
+#else
+/*! Run the FUSE high-level loop
  *
- *  @param[in]  path Path to open
- *  @param[out] fi   Open directory information
+ *  @param[in] args Command-line arguments
+ *  @param[in] ops  FUSE operations
  *
  *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns 1 for failure
  */
 static int
-nitro_opendir(const char            *path,
-              struct fuse_file_info *fi)
+nitro_hl_main(struct fuse_args             *args,
+              const struct fuse_operations *ops)
 {
-  nitrofs_entry_t *entry;
+  struct fuse *fuse;
+  char        *mountpoint;
+  int         multithreaded, rc;
 
-  /* lookup the path */
-  entry = nitro_traverse_path(path);
-  if(entry == NULL)
-    return -ENOENT;
+  /* without an explicit worker count, let libfuse decide */
+  if(nitro_opts.threads == 0)
+    return fuse_main(args->argc, args->argv, ops, NULL);
 
-  /* make sure this is a directory */
-  if(entry->type != NITRO_DIR_TYPE)
-    return -EISDIR;
+  fuse = fuse_setup(args->argc, args->argv, ops, sizeof(*ops),
+                    &mountpoint, &multithreaded, NULL);
+  if(fuse == NULL)
+    return 1;
 
-  /* set the open directory info to point to our found entry */
-  fi->fh = (unsigned long)entry;
-  return 0;
+  if(multithreaded)
+    rc = nitro_session_loop(fuse_get_session(fuse), nitro_opts.threads);
+  else
+    rc = fuse_loop(fuse);
+
+  fuse_teardown(fuse, mountpoint);
+
+  return rc == 0 ? 0 : 1;
 }
 
-/*! Cleanup after unmount
+/*! Run the FUSE low-level loop
  *
- *  @param[in] data Unused
+ *  @param[in] args Command-line arguments
+ *
+ *  @returns 0 for success
+ *  @returns 1 for failure
  */
-static void
-nitro_destroy(void *data)
+static int
+nitro_ll_main(struct fuse_args *args)
 {
-  nitro_destroy_tree(root);
-}
+  struct fuse_session *se;
+  struct fuse_chan    *ch;
+  char                *mountpoint;
+  int                 multithreaded, foreground, rc = -1;
 
-/*! NitroFS FUSE operations */
-static const struct fuse_operations nitro_ops =
-{
-  .getattr          = nitro_getattr,
-  .readdir          = nitro_readdir,
-  .open             = nitro_open,
-  .read             = nitro_read,
-  .opendir          = nitro_opendir,
-  .destroy          = nitro_destroy,
-  .flag_nullpath_ok = 1,
-  .flag_nopath      = 1,
-};
+  if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != 0)
+    return 1;
+
+  /* mount the filesystem */
+  ch = fuse_mount(mountpoint, args);
+  if(ch == NULL)
+  {
+    free(mountpoint);
+    return 1;
+  }
+
+  /* create a session */
+  se = fuse_lowlevel_new(args, &nitro_ll_ops, sizeof(nitro_ll_ops), NULL);
+  if(se != NULL)
+  {
+    if(fuse_set_signal_handlers(se) == 0)
+    {
+      fuse_session_add_chan(se, ch);
+      nitro_notify = ch;
+
+      /* run the session loop */
+      if(fuse_daemonize(foreground) == 0)
+      {
+        if(!multithreaded)
+          rc = fuse_session_loop(se);
+        else if(nitro_opts.threads == 0)
+          rc = fuse_session_loop_mt(se);
+        else
+          rc = nitro_session_loop(se, nitro_opts.threads);
+      }
+
+      fuse_remove_signal_handlers(se);
+      fuse_session_remove_chan(ch);
+    }
+    fuse_session_destroy(se);
+  }
+
+  /* clean up */
+  fuse_unmount(mountpoint, ch);
+  free(mountpoint);
+
+  return rc == 0 ? 0 : 1;
+}
+#endif
 
 /*! fuse_opt_parse callback
  *
@@ -586,66 +5935,126 @@ nitro_process_arg(void             *data,
   return 1;
 }
 
+/*! Define a command-line option
+ *
+ *  @param[in] t Option template
+ *  @param[in] p nitro_options_t member
+ *  @param[in] v Value to set
+ */
+#define NITRO_OPT(t, p, v) { t, offsetof(nitro_options_t, p), v }
+
+/*! Command-line option specification */
+static const struct fuse_opt nitro_opt_spec[] =
+{
+  NITRO_OPT("lowlevel",             lowlevel,         1),
+  NITRO_OPT("splice",               splice,           1),
+  NITRO_OPT("threads=%u",           threads,          0),
+  NITRO_OPT("lazy",                 lazy,             1),
+  NITRO_OPT("cache_dir=%s",         cache_dir,        0),
+  NITRO_OPT("prebuild",             prebuild,         1),
+  NITRO_OPT("multi",                multi,            1),
+  NITRO_OPT("entry_timeout=%lf",    entry_timeout,    0),
+  NITRO_OPT("attr_timeout=%lf",     attr_timeout,     0),
+  NITRO_OPT("negative_timeout=%lf", negative_timeout, 0),
+  NITRO_OPT("stats",                stats,            1),
+  NITRO_OPT("watch",                watch,            1),
+  NITRO_OPT("lz",                   lz,               1),
+  NITRO_OPT("cache_size=%u",        cache_size,       0),
+  NITRO_OPT("narc",                 narc,             1),
+  NITRO_OPT("sys",                  sys,              1),
+  NITRO_OPT("by_id",                by_id,            1),
+  NITRO_OPT("max_read=%u",          max_read,         0),
+  NITRO_OPT("max_readahead=%u",     max_readahead,    0),
+  NITRO_OPT("populate=%u",          populate,         0),
+  NITRO_OPT("mlock",                mlock,            1),
+  NITRO_OPT("hugepages",            hugepages,        1),
+  NITRO_OPT("preload",              preload,          1),
+  NITRO_OPT("preload_threads=%u",   preload_threads,  0),
+  FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
-  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-  struct stat      st;
-  int              fd, rc;
+  struct fuse_args       args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_operations ops = nitro_ops;
+  char                   timeouts[128];
+  char                   max_read[32];
+  int                    rc;
 
   /* parse options */
-  if(fuse_opt_parse(&args, NULL, NULL, nitro_process_arg) != 0)
+  if(fuse_opt_parse(&args, &nitro_opts, nitro_opt_spec, nitro_process_arg) != 0)
     return EXIT_FAILURE;
   if(nds_file == NULL)
     return EXIT_FAILURE;
 
-  /* open the nds file */
-  fd = open(nds_file, O_RDONLY);
-  if(fd < 0)
+  /* build index cache files and exit */
+  if(nitro_opts.prebuild)
   {
-    perror("open");
-    return EXIT_FAILURE;
+    if(nitro_opts.cache_dir == NULL)
+    {
+      fprintf(stderr, "prebuild requires -o cache_dir=DIR\n");
+      return EXIT_FAILURE;
+    }
+    rc = nitro_prebuild(nds_file);
+    fuse_opt_free_args(&args);
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
-  /* get the file information */
-  rc = fstat(fd, &st);
-  if(rc != 0)
+  if(nitro_opts.multi)
   {
-    perror("fstat");
-    close(fd);
-    return EXIT_FAILURE;
+    /* mount every nds file in the directory; each is loaded on first use */
+    if(nitro_scan_roms(nds_file) != 0)
+      return EXIT_FAILURE;
+  }
+  else
+  {
+    /* load the nds file up front */
+    if(nitro_single_rom(nds_file) != 0)
+      return EXIT_FAILURE;
   }
 
-  /* set up global data about the nds file */
-  nds_size = st.st_size;
-  nds_atime = st.st_atime;
-  nds_mtime = st.st_mtime;
-  nds_ctime = st.st_ctime;
+  nitro_cache.limit = (size_t)nitro_opts.cache_size << 20;
 
-  /* mmap the nds file */
-  nds_mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
-  if(nds_mapping == MAP_FAILED)
+  /* splice mode reads from the file */
+  if(nitro_opts.splice)
+    ops.read_buf = nitro_read_buf;
+
+  /* the high-level library applies the cache timeouts itself, and only
+   * reports our inode numbers with use_ino
+   */
+  if(!nitro_opts.lowlevel)
   {
-    perror("mmap");
-    return EXIT_FAILURE;
+    snprintf(timeouts, sizeof(timeouts),
+             "-ouse_ino,entry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+             nitro_opts.entry_timeout, nitro_opts.attr_timeout,
+             nitro_opts.negative_timeout);
+    if(fuse_opt_add_arg(&args, timeouts) != 0)
+    {
+      nitro_free_roms();
+      return EXIT_FAILURE;
+    }
   }
 
-  /* copy some more global data */
-  memcpy(&fnt_offset, nds_mapping + FNT_OFFSET, sizeof(fnt_offset));
-  memcpy(&fnt_length, nds_mapping + FNT_LENGTH, sizeof(fnt_length));
-  memcpy(&fat_offset, nds_mapping + FAT_OFFSET, sizeof(fat_offset));
-  memcpy(&fat_length, nds_mapping + FAT_LENGTH, sizeof(fat_length));
-
-  /* build the nitro tree */
-  if(nitro_build_tree() != 0)
-    return EXIT_FAILURE;
+  /* the kernel splits reads at max_read, which has to be a mount option */
+  if(nitro_opts.max_read != 0)
+  {
+    snprintf(max_read, sizeof(max_read), "-omax_read=%u", nitro_opts.max_read);
+    if(fuse_opt_add_arg(&args, max_read) != 0)
+    {
+      nitro_free_roms();
+      return EXIT_FAILURE;
+    }
+  }
 
   /* run the FUSE loop */
-  rc = fuse_main(args.argc, args.argv, &nitro_ops, NULL);
+  if(nitro_opts.lowlevel)
+    rc = nitro_ll_main(&args);
+  else
+    rc = nitro_hl_main(&args, &ops);
 
   /* clean up */
   fuse_opt_free_args(&args);
-  munmap(nds_mapping, st.st_size);
+  nitro_free_roms();
 
   return rc;
 }
\ No newline at end of file
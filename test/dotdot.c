@@ -0,0 +1,140 @@
+/*! Listing . and .. of directories served from another tree
+ *
+ *  An archive's children come from the archive's own tree, and a mount
+ *  directory's from its NDS file's, but . and .. in their listings must
+ *  still be the directory and its parent as getattr sees them, since
+ *  with use_ino their inode numbers reach userspace as d_ino.
+ */
+#define main nitrofs_main
+#include "../nitrofs.c"
+#undef main
+
+#include "../bench/rom.h"
+
+/*! Synthetic NDS file */
+#define TEST_ROM "dotdot.nds"
+
+/*! Directory of NDS files for multi mode, holding TEST_ROM */
+#define TEST_DIR "dotdot.d"
+
+/*! Inodes of . and .. from the last listing */
+static ino_t test_dot, test_dotdot;
+
+/*! Collect the inodes of . and .. from a listing
+ *
+ *  @param[in] buffer Unused
+ *  @param[in] name   Entry name
+ *  @param[in] st     Entry attributes
+ *  @param[in] offset Unused
+ *
+ *  @returns 0 to keep listing
+ */
+static int
+test_filler(void              *buffer,
+            const char        *name,
+            const struct stat *st,
+#if FUSE_USE_VERSION >= 30
+            off_t             offset,
+            enum fuse_fill_dir_flags flags)
+#else
+            off_t             offset)
+#endif
+{
+  if(strcmp(name, ".") == 0)
+    test_dot = st->st_ino;
+  else if(strcmp(name, "..") == 0)
+    test_dotdot = st->st_ino;
+  return 0;
+}
+
+/*! Check . and .. of a directory against getattr
+ *
+ *  @param[in] path   Directory to list
+ *  @param[in] parent Its parent directory
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+test_dots(const char *path,
+          const char *parent)
+{
+  struct fuse_file_info fi;
+  struct stat           st, parent_st;
+
+  memset(&fi, 0, sizeof(fi));
+  test_dot = test_dotdot = 0;
+  if(nitro_getattr(path, &st) != 0 || nitro_getattr(parent, &parent_st) != 0
+  || nitro_opendir(path, &fi) != 0)
+  {
+    fprintf(stderr, "%s: not found\n", path);
+    return -1;
+  }
+
+  nitro_readdir(path, NULL, test_filler, 0, &fi);
+  nitro_releasedir(path, &fi);
+
+  if(test_dot != st.st_ino || test_dotdot != parent_st.st_ino)
+  {
+    fprintf(stderr, "%s: . is %#jx, not %#jx; .. is %#jx, not %#jx\n", path,
+            (uintmax_t)test_dot, (uintmax_t)st.st_ino,
+            (uintmax_t)test_dotdot, (uintmax_t)parent_st.st_ino);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char narc[0x48] = { 0 };
+  rom_file_t    file = { "x.narc", narc, sizeof(narc) };
+  int           rc = EXIT_FAILURE;
+
+  /* a NARC holding one nameless 4-byte file */
+  memcpy(narc, "NARC", 4);
+  rom_put32(narc + 0x04, 0x0100FFFE);
+  rom_put32(narc + 0x08, sizeof(narc));
+  rom_put32(narc + 0x0C, 0x00030010);
+  memcpy(narc + 0x10, "BTAF", 4);
+  rom_put32(narc + 0x14, 0x14);
+  rom_put32(narc + 0x18, 1);
+  rom_put32(narc + 0x20, 4);
+  memcpy(narc + 0x24, "BTNF", 4);
+  rom_put32(narc + 0x28, 0x18);
+  rom_put32(narc + 0x2C, 8);
+  rom_put32(narc + 0x30, 0x00010000);
+  memcpy(narc + 0x3C, "GMIF", 4);
+  rom_put32(narc + 0x40, 0x0C);
+
+  if(rom_write(TEST_ROM, &file, 1) != 0)
+    return EXIT_FAILURE;
+  if(mkdir(TEST_DIR, 0755) != 0 || link(TEST_ROM, TEST_DIR "/" TEST_ROM) != 0)
+    goto out;
+
+  nitro_opts.narc = 1;
+  if(nitro_single_rom(TEST_ROM) != 0)
+    goto out;
+
+  /* the archive's . is its file, and .. the directory holding it */
+  if(test_dots("/", "/") != 0 || test_dots("/x.narc", "/") != 0)
+    goto out;
+  nitro_free_roms();
+
+  /* a mount directory's . is itself rather than its NDS file's root */
+  nitro_opts.multi = 1;
+  if(nitro_scan_roms(TEST_DIR) != 0
+  || test_dots("/", "/") != 0
+  || test_dots("/" TEST_ROM, "/") != 0
+  || test_dots("/" TEST_ROM "/x.narc", "/" TEST_ROM) != 0)
+    goto out;
+
+  rc = EXIT_SUCCESS;
+
+out:
+  nitro_free_roms();
+  unlink(TEST_DIR "/" TEST_ROM);
+  rmdir(TEST_DIR);
+  unlink(TEST_ROM);
+  printf("%s: %s\n", argv[0], rc == EXIT_SUCCESS ? "ok" : "FAILED");
+  return rc;
+}
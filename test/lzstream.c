@@ -0,0 +1,150 @@
+/*! Streaming an LZ77 file larger than the derived data cache
+ *
+ *  Such a file can't be cached, so it must be kept while it is open;
+ *  otherwise every read decompresses the whole file again. Reads it front
+ *  to back the way the kernel does, checks the contents, and checks that
+ *  it was decompressed once per open.
+ */
+#define main nitrofs_main
+#include "../nitrofs.c"
+#undef main
+
+#include "../bench/rom.h"
+
+/*! Synthetic NDS file */
+#define TEST_ROM "lzstream.nds"
+
+/*! Decompressed size of the test file */
+#define TEST_SIZE (4 << 20)
+
+/*! Cache budget, well below TEST_SIZE */
+#define TEST_CACHE (1 << 20)
+
+/*! Compress data as LZ10, using only matches 16 bytes back
+ *
+ *  @param[in]  data Data to compress
+ *  @param[in]  size Size of data
+ *  @param[out] len  Set to the compressed length
+ *
+ *  @returns compressed data (free with free)
+ *  @returns NULL for failure
+ */
+static unsigned char*
+test_lz10(const unsigned char *data,
+          uint32_t            size,
+          uint32_t            *len)
+{
+  unsigned char *out, *p, *flags;
+  uint32_t      pos = 0, count;
+  int           bit;
+
+  out = (unsigned char*)malloc(4 + size + size/8 + 4);
+  if(out == NULL)
+    return NULL;
+
+  out[0] = NITRO_LZ10;
+  out[1] = size;
+  out[2] = size >> 8;
+  out[3] = size >> 16;
+  p = out + 4;
+
+  while(pos < size)
+  {
+    flags  = p++;
+    *flags = 0;
+    for(bit = 0x80; bit != 0 && pos < size; bit >>= 1)
+    {
+      for(count = 0; pos >= 16 && count < 18 && pos + count < size
+                     && data[pos + count] == data[pos + count - 16]; ++count)
+        ;
+
+      if(count >= 3)
+      {
+        /* the displacement is stored less one */
+        *flags |= bit;
+        *p++ = (count - 3) << 4;
+        *p++ = 16 - 1;
+        pos += count;
+      }
+      else
+        *p++ = data[pos++];
+    }
+  }
+
+  while((p - out) % 4 != 0)
+    *p++ = 0;
+
+  *len = p - out;
+  return out;
+}
+
+int main(int argc, char *argv[])
+{
+  static char           buffer[128 << 10];
+  unsigned char         *data, *packed;
+  rom_file_t            file = { "big.lz", NULL, 0 };
+  struct fuse_file_info fi;
+  struct stat           st;
+  off_t                 offset;
+  uint32_t              i, len = 0;
+  int                   n, pass, rc = EXIT_FAILURE;
+
+  /* mostly repeating, so it compresses, with a change every 4 KiB */
+  data = (unsigned char*)malloc(TEST_SIZE);
+  if(data == NULL)
+    return EXIT_FAILURE;
+  for(i = 0; i < TEST_SIZE; ++i)
+    data[i] = (i % 16) ^ (i >> 12);
+
+  packed = test_lz10(data, TEST_SIZE, &len);
+  file.data = packed;
+  file.size = len;
+  if(packed == NULL || rom_write(TEST_ROM, &file, 1) != 0)
+    return EXIT_FAILURE;
+
+  nitro_opts.lz     = 1;
+  nitro_cache.limit = TEST_CACHE;
+  if(nitro_single_rom(TEST_ROM) != 0)
+    goto out;
+
+  if(nitro_getattr("/big.lz", &st) != 0 || st.st_size != TEST_SIZE)
+  {
+    fprintf(stderr, "big.lz: not presented decompressed\n");
+    goto out;
+  }
+
+  /* stream it twice; each open decompresses it once */
+  for(pass = 1; pass <= 2; ++pass)
+  {
+    memset(&fi, 0, sizeof(fi));
+    if(nitro_open("/big.lz", &fi) != 0)
+      goto out;
+
+    for(offset = 0; (n = nitro_read("/big.lz", buffer, sizeof(buffer), offset, &fi)) > 0; offset += n)
+    {
+      if(memcmp(buffer, data + offset, n) != 0)
+      {
+        fprintf(stderr, "big.lz: wrong data at %jd\n", (intmax_t)offset);
+        goto out;
+      }
+    }
+    nitro_release("/big.lz", &fi);
+
+    if(offset != TEST_SIZE || nitro_stats.lz != (uint64_t)pass)
+    {
+      fprintf(stderr, "big.lz: read %jd bytes, decompressed %" PRIu64 " times\n",
+              (intmax_t)offset, nitro_stats.lz);
+      goto out;
+    }
+  }
+
+  rc = EXIT_SUCCESS;
+
+out:
+  nitro_free_roms();
+  unlink(TEST_ROM);
+  free(packed);
+  free(data);
+  printf("%s: %s\n", argv[0], rc == EXIT_SUCCESS ? "ok" : "FAILED");
+  return rc;
+}